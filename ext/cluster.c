@@ -35,19 +35,51 @@
 #include "cluster.h"
 #ifdef WINDOWS
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #endif
 
-// kmeans++ assignment weighted based on distance from first point chosen.
-extern void weightedassign(int nclusters, int nrows, int ncolumns,
+// kmeans++ assignment weighted based on distance from first point chosen, greedy over ntrials candidates per
+// center if ntrials > 1, returns 0 if out of memory.
+extern int weightedassign(RandomState* random, int nclusters, int nrows, int ncolumns,
+                          double** data, int** mask, double weight[], int transpose, const double eweight[],
+                          int ntrials,
+                          double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int),
+                          int clusterid[]);
+
+// k-means|| assignment, kmeans++ over candidates oversampled in a few parallel rounds, returns 0 if out of memory.
+extern int parallelassign(RandomState* random, int nclusters, int nrows, int ncolumns,
+                          double** data, int** mask, double weight[], int transpose, const double eweight[],
+                          double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int),
+                          int clusterid[]);
+
+// AFK-MC2 centers, kmeans++ approximated by Markov chains of chain_length points. only the centers are labelled,
+// the other elements are left at -1. returns 0 if out of memory.
+extern int afkmc2assign(RandomState* random, int nclusters, int nrows, int ncolumns,
+                        double** data, int** mask, double weight[], int transpose, const double eweight[],
+                        int chain_length,
+                        double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int),
+                        int clusterid[]);
+
+// draw an index with probability proportional to its share of the cumulative weights.
+extern int select_cumulative(RandomState* random, int npoints, const double cumulative[]);
+
+// kmeans++ assignment based on distance from other cluster centers, returns 0 if out of memory.
+extern int spreadoutassign(RandomState* random, int nclusters, int nrows, int ncolumns,
                            double** data, int** mask, double weight[], int transpose,
                            double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int),
                            int clusterid[]);
 
-// kmeans++ assignment based on distance from other cluster centers.
-extern void spreadoutassign(int nclusters, int nrows, int ncolumns,
-                            double** data, int** mask, double weight[], int transpose,
-                            double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int),
-                            int clusterid[]);
+// pca-part assignment, clusters split in turn along their principal axis, returns 0 if out of memory.
+extern int pcaassign(int nclusters, int nrows, int ncolumns, double** data, int** mask, double weight[],
+                     int transpose, const double eweight[], int clusterid[]);
+
+// principal axes of a set of points, scaled by scale[] if not NULL, returns 0 if out of memory.
+extern int principal_axes(int ndata, int nmembers, const int members[], double** data, int** mask,
+                          const double weight[], int transpose, const double eweight[], const double scale[],
+                          int naxes, double mean[], double** axes, double variance[]);
 
 /* ************************************************************************ */
 
@@ -185,9 +217,60 @@ double median (int n, double x[]) {
     return x[nr];
 }
 
+/* ************************************************************************ */
+
+typedef struct {
+    double value;
+    double weight;
+} WeightedValue;
+
+static int compareweighted (const void *a, const void *b) {
+    const double term1 = ((const WeightedValue *) a)->value;
+    const double term2 = ((const WeightedValue *) b)->value;
+    if (term1 < term2)
+        return -1;
+    if (term1 > term2)
+        return +1;
+    return 0;
+}
+
+/*
+Find the weighted median of n values: the smallest value at which the
+cumulative weight reaches half of the total weight. If it reaches exactly half,
+the value is averaged with the next one, so that with all weights equal to 1
+the result is the same as that of median.
+N.B. On exit, the array x is sorted by value.
+*/
+static double weightedmedian (int n, WeightedValue x[]) {
+    int i, j;
+    double total = 0., cumulative = 0.;
+
+    if (n < 1)
+        return 0.;
+    qsort (x, n, sizeof (WeightedValue), compareweighted);
+    for (i = 0; i < n; i++)
+        total += x[i].weight;
+    for (i = 0; i < n; i++) {
+        cumulative += x[i].weight;
+        if (cumulative > 0.5 * total)
+            return x[i].value;
+        if (cumulative == 0.5 * total && x[i].weight > 0) {
+            for (j = i + 1; j < n && x[j].weight == 0; j++);
+            return (j < n) ? 0.5 * (x[i].value + x[j].value) : x[i].value;
+        }
+    }
+    return x[n - 1].value;
+}
+
 /* ********************************************************************** */
 
-static const double *sortdata = NULL;   /* used in the quicksort algorithm */
+/* Used in the quicksort algorithm, one per thread so that sort (and with it
+ * the Spearman distance) can run in parallel. */
+#ifdef WINDOWS
+static __declspec(thread) const double *sortdata = NULL;
+#else
+static __thread const double *sortdata = NULL;
+#endif
 
 /* ---------------------------------------------------------------------- */
 
@@ -317,48 +400,6 @@ static void freedatamask (int n, double **data, int **mask) {
     free (data);
 }
 
-/* ---------------------------------------------------------------------- */
-
-/*
-This function searches the distance matrix to find the pair with the shortest
-distance between them. The indices of the pair are returned in ip and jp; the
-distance itself is returned by the function.
-
-n          (input) int
-The number of elements in the distance matrix.
-
-distmatrix (input) double**
-A ragged array containing the distance matrix. The number of columns in each
-row is one less than the row index.
-
-ip         (output) int*
-A pointer to the integer that is to receive the first index of the pair with
-the shortest distance.
-
-jp         (output) int*
-A pointer to the integer that is to receive the second index of the pair with
-the shortest distance.
-*/
-
-static double find_closest_pair (int n, double **distmatrix, int *ip, int *jp) {
-    int i, j;
-    double temp;
-    double distance = distmatrix[1][0];
-    *ip = 1;
-    *jp = 0;
-    for (i = 1; i < n; i++) {
-        for (j = 0; j < i; j++) {
-            temp = distmatrix[i][j];
-            if (temp < distance) {
-                distance = temp;
-                *ip = i;
-                *jp = j;
-            }
-        }
-    }
-    return distance;
-}
-
 /* ********************************************************************* */
 
 /*
@@ -1878,64 +1919,141 @@ static double (*setmetric (char dist))(int, double **, double **, int **, int **
 Purpose
 =======
 
-This routine returns a uniform random number between 0.0 and 1.0. Both 0.0
-and 1.0 are excluded. This random number generator is described in:
+The randomseed routine initializes the state of the xoshiro256** random number
+generator described in:
 
-Pierre l'Ecuyer
-Efficient and Portable Combined Random Number Generators
-Communications of the ACM, Volume 31, Number 6, June 1988, pages 742-749,774.
+David Blackman and Sebastiano Vigna
+Scrambled Linear Pseudorandom Number Generators
+ACM Transactions on Mathematical Software, Volume 47, Number 4, 2021, article 36.
 
-The first time this routine is called, it initializes the random number
-generator using the current time. First, the current epoch time in seconds is
-used as a seed for the random number generator in the C library. The first two
-random numbers generated by this generator are used to initialize the random
-number generator implemented in this routine.
+The four words of the state are filled by the splitmix64 generator started at
+seed, as recommended by the authors. Every seed, 0 included, gives its own
+reproducible sequence; runs that need not be reproduced take their seed from
+randomentropy.
 
 
 Arguments
 =========
 
-None.
+state      (output) RandomState*
+The generator state to initialize.
 
+seed       (input) uint64_t
+The seed. Equal seeds produce equal sequences of random numbers.
 
-Return value
-============
-
-A double-precison number between 0.0 and 1.0.
 ============================================================================
 */
-double uniform (void) {
-    int z;
-    static const int m1 = 2147483563;
-    static const int m2 = 2147483399;
-    const double scale = 1.0 / m1;
+void randomseed (RandomState *state, uint64_t seed) {
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        state->s[i] = z ^ (z >> 31);
+    }
+}
+
+/* Returns a seed for randomseed for runs that need not be reproduced, from the
+ * epoch time and a counter that is incremented atomically, so that runs started
+ * within the same second, in any thread, still differ. */
+uint64_t randomentropy (void) {
+    static volatile uint64_t counter = 0;
+#ifdef WINDOWS
+    const uint64_t count = (uint64_t) InterlockedIncrement64 ((volatile LONGLONG *) &counter);
+#else
+    const uint64_t count = __atomic_add_fetch (&counter, 1, __ATOMIC_RELAXED);
+#endif
+    return ((uint64_t) time (0) << 20) ^ count;
+}
+
+static uint64_t rotl (const uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t randomnext (RandomState *state) {
+    uint64_t *s = state->s;
+    const uint64_t result = rotl (s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl (s[3], 45);
+
+    return result;
+}
+
+/* *********************************************************************  */
+
+/*
+Purpose
+=======
+
+The randomjump routine advances the generator by 2^128 draws, which is
+equivalent to that many calls to uniform. Jumping a copy of a state repeatedly
+gives non-overlapping streams for passes or threads that run concurrently.
+
+
+Arguments
+=========
 
-    static int s1 = 0;
-    static int s2 = 0;
+state      (input/output) RandomState*
+The generator state to advance.
 
-    if (s1 == 0 || s2 == 0) {   /* initialize */
-        unsigned int initseed = (unsigned int) time (0);
-        srand (initseed);
-        s1 = rand ();
-        s2 = rand ();
+============================================================================
+*/
+void randomjump (RandomState *state) {
+    static const uint64_t jump[] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+                                     0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+    uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i, b;
+
+    for (i = 0; i < 4; i++) {
+        for (b = 0; b < 64; b++) {
+            if (jump[i] & (1ULL << b)) {
+                s0 ^= state->s[0];
+                s1 ^= state->s[1];
+                s2 ^= state->s[2];
+                s3 ^= state->s[3];
+            }
+            randomnext (state);
+        }
     }
+    state->s[0] = s0;
+    state->s[1] = s1;
+    state->s[2] = s2;
+    state->s[3] = s3;
+}
 
-    do {
-        int k;
-        k = s1 / 53668;
-        s1 = 40014 * (s1 - k * 53668) - k * 12211;
-        if (s1 < 0)
-            s1 += m1;
-        k = s2 / 52774;
-        s2 = 40692 * (s2 - k * 52774) - k * 3791;
-        if (s2 < 0)
-            s2 += m2;
-        z = s1 - s2;
-        if (z < 1)
-            z += (m1 - 1);
-    } while (z == m1);          /* To avoid returning 1.0 */
-
-    return z * scale;
+/* *********************************************************************  */
+
+/*
+Purpose
+=======
+
+This routine returns a uniform random number between 0.0 and 1.0. Both 0.0
+and 1.0 are excluded. The upper 53 bits of a xoshiro256** draw are used, see
+randomseed.
+
+
+Arguments
+=========
+
+state      (input/output) RandomState*
+The generator state, see randomseed.
+
+
+Return value
+============
+
+A double-precison number between 0.0 and 1.0.
+============================================================================
+*/
+double uniform (RandomState *state) {
+    return ((randomnext (state) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
 }
 
 /* ************************************************************************ */
@@ -1956,6 +2074,9 @@ Communications of the ACM, Volume 31, Number 2, February 1988, pages 216-222.
 Arguments
 =========
 
+random     (input/output) RandomState*
+The random number generator.
+
 p          (input) double
 The probability of a single event. This probability should be less than or
 equal to 0.5.
@@ -1971,7 +2092,7 @@ An integer drawn from a binomial distribution with parameters (p, n).
 
 ============================================================================
 */
-static int binomial (int n, double p) {
+static int binomial (RandomState *random, int n, double p) {
     const double q = 1 - p;
 
     if (n * p < 30.0) {         /* Algorithm BINV */
@@ -1979,7 +2100,7 @@ static int binomial (int n, double p) {
         const double a = (n + 1) * s;
         double r = exp (n * log (q));   /* pow() causes a crash on AIX */
         int x = 0;
-        double u = uniform ();
+        double u = uniform (random);
         while (1) {
             if (u < r)
                 return x;
@@ -2007,8 +2128,8 @@ static int binomial (int n, double p) {
         while (1) {             /* Step 1 */
             int y;
             int k;
-            double u = uniform ();
-            double v = uniform ();
+            double u = uniform (random);
+            double v = uniform (random);
             u *= p4;
             if (u <= p1)
                 return (int) (xm - p1 * v + u);
@@ -2114,6 +2235,9 @@ randomly, making sure that each cluster will receive at least one element.
 Arguments
 =========
 
+random     (input/output) RandomState*
+The random number generator.
+
 nclusters  (input) int
 The number of clusters.
 
@@ -2126,7 +2250,7 @@ The cluster number to which an element was assigned.
 
 ============================================================================
 */
-static void randomassign (int nclusters, int nelements, int clusterid[]) {
+static void randomassign (RandomState *random, int nclusters, int nelements, int clusterid[]) {
     int i, j;
     int k = 0;
     double p;
@@ -2138,7 +2262,7 @@ static void randomassign (int nclusters, int nelements, int clusterid[]) {
      */
     for (i = 0; i < nclusters - 1; i++) {
         p = 1.0 / (nclusters - i);
-        j = binomial (n, p);
+        j = binomial (random, n, p);
         n -= j;
         j += k + 1;             /* Assign at least one element to cluster i */
         for (; k < j; k++)
@@ -2150,7 +2274,7 @@ static void randomassign (int nclusters, int nelements, int clusterid[]) {
 
     /* Create a random permutation of the cluster assignments */
     for (i = 0; i < nelements; i++) {
-        j = (int) (i + (nelements - i) * uniform ());
+        j = (int) (i + (nelements - i) * uniform (random));
         k = clusterid[j];
         clusterid[j] = clusterid[i];
         clusterid[i] = k;
@@ -2269,6 +2393,97 @@ static void getclustermeans (int nclusters, int nrows, int ncolumns, double **da
     }
 }
 
+/* ---------------------------------------------------------------------- */
+
+/*
+The cluster sum routines keep, for every cluster and dimension, the running sum
+of the member values and the number of members that have a value there. The
+k-means loop uses them to update the centroids incrementally: only elements
+that change cluster are subtracted from their old cluster and added to their
+new one, instead of recomputing every centroid from all elements.
+
+If eweight is not NULL, each element counts eweight[element] times: csum holds
+weighted sums and cweight the summed weights the means are divided by, while
+ccount still counts members so that emptied sums are reset exactly.
+
+csum, ccount and cweight are laid out as [nclusters][ndata] regardless of
+transpose.
+*/
+static void getclustersums (int nclusters, int nrows, int ncolumns, double **data, int **mask,
+                            int clusterid[], const double eweight[], double csum[], int ccount[],
+                            double cweight[], int transpose) {
+
+    int i, j, k;
+    const int nelements = (transpose == 0) ? nrows : ncolumns;
+    const int ndata = (transpose == 0) ? ncolumns : nrows;
+
+    memset (csum, 0, nclusters * ndata * sizeof (double));
+    memset (ccount, 0, nclusters * ndata * sizeof (int));
+    if (eweight)
+        memset (cweight, 0, nclusters * ndata * sizeof (double));
+
+    for (k = 0; k < nelements; k++) {
+        const double w = eweight ? eweight[k] : 1.;
+        i = clusterid[k] * ndata;
+        for (j = 0; j < ndata; j++) {
+            const int present = (transpose == 0) ? mask[k][j] : mask[j][k];
+            if (present) {
+                const double value = (transpose == 0) ? data[k][j] : data[j][k];
+                csum[i + j] += eweight ? w * value : value;
+                ccount[i + j]++;
+                if (eweight)
+                    cweight[i + j] += w;
+            }
+        }
+    }
+}
+
+static void moveclustersum (int ndata, double **data, int **mask, int element, const double eweight[],
+                            int from, int to, double csum[], int ccount[], double cweight[], int transpose) {
+
+    int j;
+    double *fsum = csum + from * ndata, *tsum = csum + to * ndata;
+    int *fcount = ccount + from * ndata, *tcount = ccount + to * ndata;
+
+    for (j = 0; j < ndata; j++) {
+        const int present = (transpose == 0) ? mask[element][j] : mask[j][element];
+        if (present) {
+            double value = (transpose == 0) ? data[element][j] : data[j][element];
+            if (eweight) {
+                const double w = eweight[element];
+                value *= w;
+                cweight[to * ndata + j] += w;
+                cweight[from * ndata + j] = fcount[j] > 1 ? cweight[from * ndata + j] - w : 0.;
+            }
+            tsum[j] += value;
+            tcount[j]++;
+            /* Reset an emptied sum exactly so rounding errors do not accumulate */
+            fsum[j] = --fcount[j] ? fsum[j] - value : 0.;
+        }
+    }
+}
+
+static void getclustermeansfromsums (int nclusters, int ndata, const double csum[], const int ccount[],
+                                     const double cweight[], double **cdata, int **cmask, int transpose) {
+
+    int i, j;
+    for (i = 0; i < nclusters; i++) {
+        for (j = 0; j < ndata; j++) {
+            const int count = ccount[i * ndata + j];
+            const double total = cweight ? cweight[i * ndata + j] : count;
+            const double value = count > 0 ? csum[i * ndata + j] / total : 0.;
+            if (transpose == 0) {
+                cdata[i][j] = value;
+                cmask[i][j] = count > 0;
+            }
+            else {
+                cdata[j][i] = value;
+                cmask[j][i] = count > 0;
+            }
+        }
+    }
+}
+
 /* ********************************************************************* */
 
 /*
@@ -2320,60 +2535,160 @@ transpose  (input) int
 If transpose==0, clusters of rows (genes) are specified. Otherwise, clusters of
 columns (microarrays) are specified.
 
-cache      (input) double[nrows] if transpose==0
+eweight    (input) double[nrows] if transpose==0
                    double[ncolumns] if transpose==1
-This array should be allocated before calling getclustermedians; its contents
-on input is not relevant. This array is used as a temporary storage space when
-calculating the medians.
+If not NULL, the weight of each element: the centroid is the weighted median,
+see weightedmedian.
+
+nsample    (input) int
+If nsample > 0, the median of a cluster with more than nsample members is
+approximated by the median of nsample members drawn at random: without
+replacement, or with replacement and with probability proportional to eweight
+if eweight is not NULL. In each dimension, the approximation then lies between
+the (1/2 - e) and (1/2 + e) quantiles of the (weighted) cluster values with
+probability at least 1 - d, where e = sqrt (log (2 / d) / (2 * nsample)) (the
+Dvoretzky-Kiefer-Wolfowitz inequality), whatever the order of the elements.
+
+random     (input/output) RandomState*
+The generator the members are drawn from; only used if nsample > 0.
+
+order      (input) int[nrows] if transpose==0
+                   int[ncolumns] if transpose==1
+start      (input) int[nclusters+1]
+These arrays should be allocated before calling getclustermedians; their
+contents on input is not relevant. They are used to gather the members of each
+cluster contiguously.
+
+Return value
+============
+
+The function returns 0 if a memory allocation error occurs, 1 otherwise.
 
 ========================================================================
 */
-static void getclustermedians (int nclusters, int nrows, int ncolumns, double **data, int **mask,
-                               int clusterid[], double **cdata, int **cmask, int transpose, double cache[]) {
+static int getclustermedians (int nclusters, int nrows, int ncolumns, double **data, int **mask,
+                              int clusterid[], double **cdata, int **cmask, int transpose,
+                              const double eweight[], int nsample, RandomState *random,
+                              int order[], int start[]) {
+
+    int i, p, failed = 0;
+    int maxcount = 0;
+    int *sample = NULL;
+    double *cumulative = NULL;
+    const int nelements = (transpose == 0) ? nrows : ncolumns;
+    const int ndata = (transpose == 0) ? ncolumns : nrows;
 
-    int i, j, k;
-    if (transpose == 0) {
+    /* Counting sort of the elements by cluster; members of cluster i are
+     * order[start[i]] .. order[start[i+1]-1]. */
+    for (i = 0; i <= nclusters; i++)
+        start[i] = 0;
+    for (i = 0; i < nelements; i++)
+        start[clusterid[i] + 1]++;
+    for (i = 0; i < nclusters; i++) {
+        if (start[i + 1] > maxcount)
+            maxcount = start[i + 1];
+        start[i + 1] += start[i];
+    }
+    for (i = 0; i < nelements; i++)
+        order[start[clusterid[i]]++] = i;
+    for (i = nclusters; i > 0; i--)
+        start[i] = start[i - 1];
+    start[0] = 0;
+
+    /* Draw the members of each larger cluster the median is taken over,
+     * serially so that they only depend on the random stream. */
+    if (nsample > 0 && maxcount > nsample) {
+        sample = malloc ((size_t) nclusters * nsample * sizeof (int));
+        cumulative = eweight ? malloc (maxcount * sizeof (double)) : NULL;
+        if (!sample || (eweight && !cumulative)) {
+            free (sample);
+            free (cumulative);
+            return 0;
+        }
         for (i = 0; i < nclusters; i++) {
-            for (j = 0; j < ncolumns; j++) {
-                int count = 0;
-                for (k = 0; k < nrows; k++) {
-                    if (i == clusterid[k] && mask[k][j]) {
-                        cache[count] = data[k][j];
-                        count++;
-                    }
-                }
-                if (count > 0) {
-                    cdata[i][j] = median (count, cache);
-                    cmask[i][j] = 1;
-                }
-                else {
-                    cdata[i][j] = 0.;
-                    cmask[i][j] = 0;
+            int *members = order + start[i];
+            int *drawn = sample + (size_t) i * nsample;
+            const int nmembers = start[i + 1] - start[i];
+            int k;
+            if (nmembers <= nsample)
+                continue;
+            if (eweight) {
+                for (k = 0; k < nmembers; k++)
+                    cumulative[k] = (k > 0 ? cumulative[k - 1] : 0.) + eweight[members[k]];
+            }
+            if (eweight && cumulative[nmembers - 1] > 0) {
+                for (k = 0; k < nsample; k++)
+                    drawn[k] = members[select_cumulative (random, nmembers, cumulative)];
+            }
+            else {
+                /* Partial Fisher-Yates shuffle of the members */
+                for (k = 0; k < nsample; k++) {
+                    const int r = k + (int) ((nmembers - k) * uniform (random));
+                    const int element = members[r];
+                    members[r] = members[k];
+                    members[k] = element;
+                    drawn[k] = element;
                 }
             }
         }
+        free (cumulative);
+        maxcount = nsample;
     }
-    else {
-        for (i = 0; i < nclusters; i++) {
-            for (j = 0; j < nrows; j++) {
-                int count = 0;
-                for (k = 0; k < ncolumns; k++) {
-                    if (i == clusterid[k] && mask[j][k]) {
-                        cache[count] = data[j][k];
-                        count++;
-                    }
-                }
-                if (count > 0) {
-                    cdata[j][i] = median (count, cache);
-                    cmask[j][i] = 1;
-                }
-                else {
-                    cdata[j][i] = 0.;
-                    cmask[j][i] = 0;
+
+    /* Every (cluster, dimension) median is independent */
+    #pragma omp parallel reduction(|:failed)
+    {
+        double *cache = eweight ? NULL : malloc ((maxcount + 1) * sizeof (double));
+        WeightedValue *wcache = eweight ? malloc ((maxcount + 1) * sizeof (WeightedValue)) : NULL;
+        if (!cache && !wcache)
+            failed = 1;
+
+        #pragma omp for schedule(dynamic, 16)
+        for (p = 0; p < nclusters * ndata; p++) {
+            const int icluster = p / ndata;
+            const int j = p % ndata;
+            const int *members = order + start[icluster];
+            const int nmembers = start[icluster + 1] - start[icluster];
+            const int sampled = (nsample > 0 && nmembers > nsample);
+            const int nvalues = sampled ? nsample : nmembers;
+            double value = 0.;
+            int k, count = 0;
+
+            if (!cache && !wcache)
+                continue;
+
+            for (k = 0; k < nvalues; k++) {
+                const int element = sampled ? sample[(size_t) icluster * nsample + k] : members[k];
+                const int present = (transpose == 0) ? mask[element][j] : mask[j][element];
+                if (!present)
+                    continue;
+                if (eweight) {
+                    wcache[count].value = (transpose == 0) ? data[element][j] : data[j][element];
+                    /* Members drawn by weight count once per draw */
+                    wcache[count].weight = sampled ? 1. : eweight[element];
                 }
+                else
+                    cache[count] = (transpose == 0) ? data[element][j] : data[j][element];
+                count++;
+            }
+            if (count > 0)
+                value = eweight ? weightedmedian (count, wcache) : median (count, cache);
+
+            if (transpose == 0) {
+                cdata[icluster][j] = value;
+                cmask[icluster][j] = count > 0;
+            }
+            else {
+                cdata[j][icluster] = value;
+                cmask[j][icluster] = count > 0;
             }
         }
+        free (cache);
+        free (wcache);
     }
+
+    free (sample);
+    return !failed;
 }
 
 /* ********************************************************************* */
@@ -2434,6 +2749,10 @@ belonging to a cluster for each dimension.
 For method=='m', the centroid is defined as the median over all elements
 belonging to a cluster for each dimension.
 
+eweight    (input) double[nrows] if transpose==0
+                   double[ncolumns] if transpose==1
+If not NULL, the weight of each element in the (weighted) mean or median.
+
 Return value
 ============
 
@@ -2443,20 +2762,43 @@ returns 0. If successful, getclustercentroids returns 1.
 ========================================================================
 */
 int getclustercentroids (int nclusters, int nrows, int ncolumns, double **data, int **mask,
-                         int clusterid[], double **cdata, int **cmask, int transpose, char method) {
+                         int clusterid[], double **cdata, int **cmask, int transpose, char method,
+                         const double eweight[]) {
     switch (method) {
         case 'm': {
             const int nelements = (transpose == 0) ? nrows : ncolumns;
-            double *cache = malloc (nelements * sizeof (double));
-            if (!cache)
-                return 0;
-            getclustermedians (nclusters, nrows, ncolumns, data, mask, clusterid, cdata, cmask, transpose, cache);
-            free (cache);
-            return 1;
+            int ok = 0;
+            int *order = malloc (nelements * sizeof (int));
+            int *start = malloc ((nclusters + 1) * sizeof (int));
+            if (order && start)
+                ok = getclustermedians (nclusters, nrows, ncolumns, data, mask, clusterid, cdata, cmask,
+                                        transpose, eweight, 0, NULL, order, start);
+            free (order);
+            free (start);
+            return ok;
         }
         case 'a': {
-            getclustermeans (nclusters, nrows, ncolumns, data, mask, clusterid, cdata, cmask, transpose);
-            return 1;
+            const int ndata = (transpose == 0) ? ncolumns : nrows;
+            int ok;
+            double *csum, *cweight;
+            int *ccount;
+            if (!eweight) {
+                getclustermeans (nclusters, nrows, ncolumns, data, mask, clusterid, cdata, cmask, transpose);
+                return 1;
+            }
+            csum = malloc (nclusters * ndata * sizeof (double));
+            ccount = malloc (nclusters * ndata * sizeof (int));
+            cweight = malloc (nclusters * ndata * sizeof (double));
+            ok = csum && ccount && cweight;
+            if (ok) {
+                getclustersums (nclusters, nrows, ncolumns, data, mask, clusterid, eweight, csum, ccount,
+                                cweight, transpose);
+                getclustermeansfromsums (nclusters, ndata, csum, ccount, cweight, cdata, cmask, transpose);
+            }
+            free (csum);
+            free (ccount);
+            free (cweight);
+            return ok;
         }
     }
 
@@ -2482,11 +2824,9 @@ The number of clusters.
 nelements  (input) int
 The total number of elements.
 
-distmatrix (input) double array, ragged
-  (number of rows is nelements, number of columns is equal to the row number)
-The distance matrix. To save space, the distance matrix is given in the
-form of a ragged array. The distance matrix is symmetric and has zeros
-on the diagonal. See distancematrix for a description of the content.
+distmatrix (input) DistanceMatrix*
+The distance matrix between the nelements elements. To save space, only the
+lower triangle is stored, see distancematrix.
 
 clusterid  (output) int[nelements]
 The cluster number to which each element belongs.
@@ -2500,7 +2840,7 @@ centroid.
 
 ========================================================================
 */
-void getclustermedoids (int nclusters, int nelements, double **distance,
+void getclustermedoids (int nclusters, int nelements, const DistanceMatrix *distance,
                         int clusterid[], int centroids[], double errors[]) {
 
     int i, j, k;
@@ -2512,7 +2852,7 @@ void getclustermedoids (int nclusters, int nelements, double **distance,
         for (k = 0; k < nelements; k++) {
             if (i == k || clusterid[k] != j)
                 continue;
-            d += (i < k ? distance[k][i] : distance[i][k]);
+            d += getdistance (distance, i, k);
             if (d > errors[j])
                 break;
         }
@@ -2525,70 +2865,360 @@ void getclustermedoids (int nclusters, int nelements, double **distance,
 
 /* ********************************************************************* */
 
-static int kmeans (int nclusters, int nrows, int ncolumns, double **data, int **mask,
-                   double weight[], int transpose, int npass, char dist,
-                   double **cdata, int **cmask, int clusterid[], double *error,
-                   int tclusterid[], int counts[], int mapping[], int assign) {
+/* Appends the error of one iteration to the convergence record. Recording stops
+ * silently if memory runs out. */
+static void ktraceerror (KTrace *trace, double error) {
+    if (!trace)
+        return;
+    if (trace->nerrors == trace->size) {
+        int size = trace->size ? 2 * trace->size : 64;
+        double *errors = realloc (trace->errors, size * sizeof (double));
+        if (!errors)
+            return;
+        trace->errors = errors;
+        trace->size = size;
+    }
+    trace->errors[trace->nerrors++] = error;
+}
 
-    int i, j, k;
-    const int nelements = (transpose == 0) ? nrows : ncolumns;
-    const int ndata = (transpose == 0) ? ncolumns : nrows;
-    int ifound = 1;
-    int ipass = 0;
+/* Closes a pass in the convergence record, noting the number of iterations it used. */
+static void ktracepass (KTrace *trace, int iterations) {
+    int *counts;
+    if (!trace)
+        return;
+    counts = realloc (trace->iterations, (trace->npass + 1) * sizeof (int));
+    if (!counts)
+        return;
+    trace->iterations = counts;
+    trace->iterations[trace->npass++] = iterations;
+}
 
-    /* Set the metric function as indicated by dist */
-    double (*metric) (int, double **, double **, int **, int **, const double[], int, int, int) = setmetric (dist);
+/* Returns 1 if a k-means or k-medians pass has converged as far as the caller
+ * asked for, see KParams. */
+static int kconverged (const KParams *params, int iteration, double previous, double total,
+                       int moved, int nelements) {
+    if (params->maxiter > 0 && iteration >= params->maxiter)
+        return 1;
+    if (previous != DBL_MAX && previous - total < params->tolerance * previous)
+        return 1;
+    if (moved < params->moved * nelements)
+        return 1;
+    return 0;
+}
 
-    /* We save the clustering solution periodically and check if it reappears */
-    int *saved = malloc (nelements * sizeof (int));
-    if (saved == NULL)
-        return -1;
+/* Wall clock time in seconds, for the time budget of kcluster. */
+static double kclock (void) {
+#ifdef WINDOWS
+    return GetTickCount64 () / 1000.;
+#else
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
 
-    *error = DBL_MAX;
+/* Returns 1 if no further passes should be started: the best solution has been
+ * found params->repeats times, or the time budget ending at deadline has run
+ * out (deadline is 0 if there is none). */
+static int kstoppasses (const KParams *params, double deadline, int ifound) {
+    if (params->repeats > 0 && ifound >= params->repeats)
+        return 1;
+    if (deadline > 0 && kclock () >= deadline)
+        return 1;
+    return 0;
+}
 
-    do {
-        double total = DBL_MAX;
-        int counter = 0;
-        int period = 10;
+/* Returns 1 if a pass should be abandoned before it converges, given the best
+ * error of the earlier passes: the time budget has run out, or params->abort is
+ * set and the improvements are shrinking while it would still take more than 30
+ * iterations at the current improvement to reach best. That is a guess, not a
+ * bound: the error of a k-means pass can keep dropping slowly for many more
+ * iterations, so an abandoned pass may have ended below best. *improvement keeps
+ * the last improvement between calls and should start at 0. */
+static int kabandonpass (const KParams *params, double deadline, double best, double previous, double total,
+                         double *improvement) {
+    const double change = (previous == DBL_MAX) ? 0 : previous - total;
+    const double last = *improvement;
+    *improvement = change;
+    if (best == DBL_MAX)
+        return 0;
+    if (deadline > 0 && kclock () >= deadline)
+        return 1;
+    if (params->abort && change > 0 && change < last && total - best > 30 * change)
+        return 1;
+    return 0;
+}
 
-        if (npass != 0) {
-            switch (assign) {
-                case 1:
-                    /* use kmeans++ weighted randomized initialisation */
-                    weightedassign (nclusters, nrows, ncolumns, data, mask, weight, transpose, metric, tclusterid);
-                    break;
-                case 2:
-                    /* use kmeans++ initialisation by spreading out cluster centers as much as possible */
-                    spreadoutassign (nclusters, nrows, ncolumns, data, mask, weight, transpose, metric, tclusterid);
-                    break;
-                default:
-                    /* Perform the EM algorithm. First, randomly assign elements to clusters. */
-                    randomassign (nclusters, nelements, tclusterid);
-                    break;
-            }
-        }
+/* ********************************************************************* */
 
-        for (i = 0; i < nclusters; i++)
-            counts[i] = 0;
-        for (i = 0; i < nelements; i++)
-            counts[tclusterid[i]]++;
+/* Returns the order in which the dimensions are visited by abandondistance,
+ * most discriminative (largest weighted variance) first, or NULL if distances
+ * should not be abandoned early. Abandoning applies only to the Euclidean and
+ * city-block distances, whose partial sums never decrease for non-negative
+ * weights. If prune is 0, it is used only for at least 512 dimensions. On
+ * return, *wsum holds the sum of the weights, so that a partial sum exceeding
+ * bound * wsum proves the full distance exceeds bound. */
+static int* abandonorder (int nrows, int ncolumns, double **data, int **mask, const double weight[],
+                          int transpose, char dist, int prune, double *wsum) {
+    int i, k;
+    const int nelements = (transpose == 0) ? nrows : ncolumns;
+    const int ndata = (transpose == 0) ? ncolumns : nrows;
+    double *spread;
+    int *order;
 
-        /* Start the loop */
-        while (1) {
-            double previous = total;
-            total = 0.0;
+    if (prune < 0 || (dist != 'e' && dist != 'b'))
+        return NULL;
+    if (prune == 0 && ndata < 512)
+        return NULL;
+    *wsum = 0;
+    for (k = 0; k < ndata; k++) {
+        if (weight[k] < 0)
+            return NULL;
+        *wsum += weight[k];
+    }
 
-            if (counter % period == 0) {        /* Save the current cluster assignments */
-                for (i = 0; i < nelements; i++)
-                    saved[i] = tclusterid[i];
-                if (period < INT_MAX / 2)
-                    period *= 2;
+    spread = malloc (ndata * sizeof (double));
+    order = malloc (ndata * sizeof (int));
+    if (!spread || !order) {
+        free (spread);
+        free (order);
+        return NULL;
+    }
+    for (k = 0; k < ndata; k++) {
+        double sum = 0, sum2 = 0;
+        int count = 0;
+        for (i = 0; i < nelements; i++) {
+            double x;
+            if (transpose == 0) {
+                if (!mask[i][k])
+                    continue;
+                x = data[i][k];
             }
-            counter++;
-
-            /* Find the center */
-            getclustermeans (nclusters, nrows, ncolumns, data, mask, tclusterid, cdata, cmask, transpose);
-
+            else {
+                if (!mask[k][i])
+                    continue;
+                x = data[k][i];
+            }
+            sum += x;
+            sum2 += x * x;
+            count++;
+        }
+        /* Negated, so that sort puts the largest spread first */
+        spread[k] = count ? -weight[k] * (sum2 - sum * sum / count) / count : 0;
+    }
+    sort (ndata, spread, order);
+    free (spread);
+    return order;
+}
+
+/* Euclidean or city-block distance between element index1 and centroid
+ * index2, visiting the dimensions in the given order. Every 16 dimensions the
+ * partial weighted sum is compared with bound; once it exceeds bound the
+ * remaining terms cannot bring the distance back down, so DBL_MAX is returned
+ * and the number of skipped terms is added to *skipped. A distance that is not
+ * abandoned is summed again in the order of the dimensions, so that it rounds
+ * exactly like euclid or cityblock and ties are broken as without abandoning;
+ * bound gets a relative margin of 1e-9 so that the rounding of the reordered
+ * partial sums cannot abandon a distance that would have won a near-tie. */
+static double abandondistance (char dist, int n, double **data1, double **data2, int **mask1, int **mask2,
+                               const double weight[], int index1, int index2, int transpose,
+                               const int order[], double bound, long *skipped) {
+    int i, k;
+    double result = 0;
+
+    bound *= 1 + 1e-9;
+    for (k = 0; k < n; k++) {
+        double term;
+        i = order[k];
+        if (transpose == 0) {
+            if (!mask1[index1][i] || !mask2[index2][i])
+                continue;
+            term = data1[index1][i] - data2[index2][i];
+        }
+        else {
+            if (!mask1[i][index1] || !mask2[i][index2])
+                continue;
+            term = data1[i][index1] - data2[i][index2];
+        }
+        result += weight[i] * ((dist == 'e') ? term * term : fabs (term));
+        if ((k & 15) == 15 && result > bound) {
+            *skipped += n - k - 1;
+            return DBL_MAX;
+        }
+    }
+    return (dist == 'e') ? euclid (n, data1, data2, mask1, mask2, weight, index1, index2, transpose)
+                         : cityblock (n, data1, data2, mask1, mask2, weight, index1, index2, transpose);
+}
+
+/* Initial assignment of a k-means or k-medians pass, see assign in kcluster.
+ * The kmeans++ style seedings draw elements in proportion to params->eweight.
+ * AFK-MC2 labels only its centers and leaves the other elements at -1, see
+ * seedcentroids. Returns 0 if out of memory. */
+static int seedassign (RandomState *random, int assign, int nclusters, int nrows, int ncolumns,
+                       double **data, int **mask, double weight[], int transpose,
+                       double (*metric) (int, double **, double **, int **, int **, const double[], int, int, int),
+                       int clusterid[], const KParams *params) {
+    const int nelements = (transpose == 0) ? nrows : ncolumns;
+
+    switch (assign) {
+        case 1:
+            /* use kmeans++ weighted randomized initialisation */
+            return weightedassign (random, nclusters, nrows, ncolumns, data, mask, weight, transpose,
+                                   params->eweight, params->candidates, metric, clusterid);
+        case 2:
+            /* use kmeans++ initialisation by spreading out cluster centers as much as possible */
+            return spreadoutassign (random, nclusters, nrows, ncolumns, data, mask, weight, transpose, metric, clusterid);
+        case 3:
+            /* use k-means|| initialisation, kmeans++ over candidates oversampled in parallel rounds */
+            return parallelassign (random, nclusters, nrows, ncolumns, data, mask, weight, transpose,
+                                   params->eweight, metric, clusterid);
+        case 4:
+            /* use AFK-MC2 initialisation, kmeans++ approximated by short Markov chains */
+            return afkmc2assign (random, nclusters, nrows, ncolumns, data, mask, weight, transpose,
+                                 params->eweight, params->chain, metric, clusterid);
+        case 5:
+            /* use PCA-part initialisation, deterministic splits along principal axes */
+            return pcaassign (nclusters, nrows, ncolumns, data, mask, weight, transpose, params->eweight, clusterid);
+        default:
+            /* Perform the EM algorithm. First, randomly assign elements to clusters. */
+            randomassign (random, nclusters, nelements, clusterid);
+            return 1;
+    }
+}
+
+/* Copies the elements labelled by a seeding that leaves the others at -1 into
+ * the centroids, so that the first iteration assigns every element to the
+ * closest center instead of the seeding doing so. */
+static void seedcentroids (int nelements, int ndata, double **data, int **mask, const int clusterid[],
+                           double **cdata, int **cmask, int transpose) {
+    int i, j, k;
+
+    for (i = 0; i < nelements; i++) {
+        k = clusterid[i];
+        if (k < 0)
+            continue;
+        for (j = 0; j < ndata; j++) {
+            if (transpose == 0) {
+                cdata[k][j] = data[i][j];
+                cmask[k][j] = mask[i][j];
+            }
+            else {
+                cdata[j][k] = data[j][i];
+                cmask[j][k] = mask[j][i];
+            }
+        }
+    }
+}
+
+/* ********************************************************************* */
+
+static int kmeans (int nclusters, int nrows, int ncolumns, double **data, int **mask,
+                   double weight[], int transpose, int npass, char dist,
+                   double **cdata, int **cmask, int clusterid[], double *error,
+                   int tclusterid[], int counts[], int mapping[], int assign, const KParams *params,
+                   RandomState stream) {
+
+    int i, j, k;
+    const int nelements = (transpose == 0) ? nrows : ncolumns;
+    const int ndata = (transpose == 0) ? ncolumns : nrows;
+    int ifound = 1;
+    int ipass = 0;
+
+    /* Set the metric function as indicated by dist */
+    double (*metric) (int, double **, double **, int **, int **, const double[], int, int, int) = setmetric (dist);
+
+    /* Passes stop being started, and unfinished ones are abandoned, at the deadline */
+    const double deadline = (params->budget > 0) ? kclock () + params->budget : 0;
+
+    /* Running per-cluster sums, so that centroids are updated only for moved elements */
+    const double *eweight = params->eweight;
+    double *csum;
+    int *ccount;
+    double *cweight = NULL;
+
+    /* Early abandoning of centroids that cannot be nearer, see abandonorder */
+    double wsum = 0;
+    long skipped = 0;
+    int *order = abandonorder (nrows, ncolumns, data, mask, weight, transpose, dist, params->prune, &wsum);
+
+    /* We save the clustering solution periodically and check if it reappears */
+    int *saved = malloc (nelements * sizeof (int));
+    if (saved == NULL) {
+        free (order);
+        return -1;
+    }
+
+    csum = malloc (nclusters * ndata * sizeof (double));
+    ccount = malloc (nclusters * ndata * sizeof (int));
+    if (eweight)
+        cweight = malloc (nclusters * ndata * sizeof (double));
+    if (!csum || !ccount || (eweight && !cweight)) {
+        free (csum);
+        free (ccount);
+        free (cweight);
+        free (saved);
+        free (order);
+        return -1;
+    }
+
+    *error = DBL_MAX;
+
+    do {
+        double total = DBL_MAX;
+        double improvement = 0;
+        int abandoned = 0;
+        int counter = 0;
+        int period = 10;
+
+        /* The seeding left elements at -1, the first iteration starts from the centers */
+        int seeded = 0;
+
+        RandomState random = stream;
+        randomjump (&stream);
+
+        if (npass != 0 && !seedassign (&random, assign, nclusters, nrows, ncolumns, data, mask, weight, transpose,
+                                       metric, tclusterid, params)) {
+            free (cweight);
+            free (ccount);
+            free (csum);
+            free (saved);
+            free (order);
+            return -1;
+        }
+
+        for (i = 0; i < nclusters; i++)
+            counts[i] = 0;
+        for (i = 0; i < nelements; i++) {
+            if (tclusterid[i] < 0)
+                seeded = 1;
+            else
+                counts[tclusterid[i]]++;
+        }
+
+        if (seeded)
+            seedcentroids (nelements, ndata, data, mask, tclusterid, cdata, cmask, transpose);
+        else
+            getclustersums (nclusters, nrows, ncolumns, data, mask, tclusterid, eweight, csum, ccount, cweight,
+                            transpose);
+
+        /* Start the loop */
+        while (1) {
+            double previous = total;
+            int moved = 0;
+            total = 0.0;
+
+            if (counter % period == 0) {        /* Save the current cluster assignments */
+                for (i = 0; i < nelements; i++)
+                    saved[i] = tclusterid[i];
+                if (period < INT_MAX / 2)
+                    period *= 2;
+            }
+            counter++;
+
+            /* Find the center */
+            if (!seeded)
+                getclustermeansfromsums (nclusters, ndata, csum, ccount, cweight, cdata, cmask, transpose);
+
             /* Calculate the distances */
             for (i = 0; i < nelements; i++) {
                 double distance;
@@ -2596,31 +3226,52 @@ static int kmeans (int nclusters, int nrows, int ncolumns, double **data, int **
 
                 /* No reassignment if that would lead to an empty cluster */
                 /* Treat the present cluster as a special case */
-                if (counts[k] == 1)
+                if (k >= 0 && counts[k] == 1)
                     continue;
 
-                distance = metric (ndata, data, cdata, mask, cmask, weight, i, k, transpose);
+                distance = (k >= 0) ? metric (ndata, data, cdata, mask, cmask, weight, i, k, transpose) : DBL_MAX;
 
                 for (j = 0; j < nclusters; j++) {
                     double tdistance;
                     if (j == k)
                         continue;
-                    tdistance = metric (ndata, data, cdata, mask, cmask, weight, i, j, transpose);
+                    if (order)
+                        tdistance = abandondistance (dist, ndata, data, cdata, mask, cmask, weight, i, j,
+                                                     transpose, order, distance * wsum, &skipped);
+                    else
+                        tdistance = metric (ndata, data, cdata, mask, cmask, weight, i, j, transpose);
                     if (tdistance < distance) {
                         distance = tdistance;
-                        counts[tclusterid[i]]--;
+                        if (tclusterid[i] >= 0)
+                            counts[tclusterid[i]]--;
                         tclusterid[i] = j;
                         counts[j]++;
                     }
                 }
-                total += distance;
+                total += eweight ? eweight[i] * distance : distance;
+
+                if (tclusterid[i] != k) {
+                    if (!seeded)
+                        moveclustersum (ndata, data, mask, i, eweight, k, tclusterid[i], csum, ccount, cweight,
+                                        transpose);
+                    moved++;
+                }
             }
+            if (seeded) {
+                getclustersums (nclusters, nrows, ncolumns, data, mask, tclusterid, eweight, csum, ccount, cweight,
+                                transpose);
+                seeded = 0;
+            }
+            ktraceerror (params->trace, total);
 
             /* total>=previous is FALSE on some machines even if total and previous
              * are bitwise identical. */
             if (total >= previous)
                 break;
 
+            if (kconverged (params, counter, previous, total, moved, nelements))
+                break;
+
             for (i = 0; i < nelements; i++)
                 if (saved[i] != tclusterid[i])
                     break;
@@ -2628,12 +3279,22 @@ static int kmeans (int nclusters, int nrows, int ncolumns, double **data, int **
             /* Identical solution found; break out of this loop */
             if (i == nelements)
                 break;
+
+            /* No need to finish a pass that cannot beat the best one */
+            if (npass > 1 && kabandonpass (params, deadline, *error, previous, total, &improvement)) {
+                abandoned = 1;
+                break;
+            }
         }
 
+        ktracepass (params->trace, counter);
+
         if (npass <= 1) {
             *error = total;
             break;
         }
+        if (abandoned)
+            continue;
 
         for (i = 0; i < nclusters; i++)
             mapping[i] = -1;
@@ -2656,8 +3317,15 @@ static int kmeans (int nclusters, int nrows, int ncolumns, double **data, int **
         /* break statement not encountered */
         if (i == nelements)
             ifound++;
-    } while (++ipass < npass);
+    } while (++ipass < npass && !kstoppasses (params, deadline, ifound));
 
+    if (params->trace)
+        params->trace->skipped += skipped;
+
+    free (order);
+    free (cweight);
+    free (ccount);
+    free (csum);
     free (saved);
     return ifound;
 }
@@ -2667,7 +3335,8 @@ static int kmeans (int nclusters, int nrows, int ncolumns, double **data, int **
 static int kmedians (int nclusters, int nrows, int ncolumns, double **data, int **mask,
                      double weight[], int transpose, int npass, char dist,
                      double **cdata, int **cmask, int clusterid[], double *error,
-                     int tclusterid[], int counts[], int mapping[], double cache[], int assign) {
+                     int tclusterid[], int counts[], int mapping[], int members[], int start[], int assign,
+                     const KParams *params, RandomState stream) {
 
     int i, j, k;
     const int nelements = (transpose == 0) ? nrows : ncolumns;
@@ -2678,32 +3347,57 @@ static int kmedians (int nclusters, int nrows, int ncolumns, double **data, int
     /* Set the metric function as indicated by dist */
     double (*metric)(int, double **, double **, int **, int **, const double[], int, int, int) = setmetric (dist);
 
+    /* Passes stop being started, and unfinished ones are abandoned, at the deadline */
+    const double deadline = (params->budget > 0) ? kclock () + params->budget : 0;
+
+    /* Early abandoning of centroids that cannot be nearer, see abandonorder */
+    double wsum = 0;
+    long skipped = 0;
+    int *order;
+
     /* We save the clustering solution periodically and check if it reappears */
     int *saved = malloc (nelements * sizeof (int));
     if (saved == NULL)
         return -1;
 
+    order = abandonorder (nrows, ncolumns, data, mask, weight, transpose, dist, params->prune, &wsum);
+
     *error = DBL_MAX;
 
     do {
         double total = DBL_MAX;
+        double improvement = 0;
+        int abandoned = 0;
         int counter = 0;
         int period = 10;
 
-        if (npass != 0) {
-            switch (assign) {
-                case 1:
-                    /* use kmeans++ weighted randomized initialisation */
-                    weightedassign(nclusters, nrows, ncolumns, data, mask, weight, transpose, metric, tclusterid);
-                    break;
-                case 2:
-                    /* use kmeans++ initialisation by spreading out cluster centers as much as possible */
-                    spreadoutassign(nclusters, nrows, ncolumns, data, mask, weight, transpose, metric, tclusterid);
-                    break;
-                default:
-                    /* Perform the EM algorithm. First, randomly assign elements to clusters. */
-                    randomassign (nclusters, nelements, tclusterid);
-                    break;
+        RandomState random = stream;
+        randomjump (&stream);
+
+        if (npass != 0 && !seedassign (&random, assign, nclusters, nrows, ncolumns, data, mask, weight, transpose,
+                                       metric, tclusterid, params)) {
+            free (order);
+            free (saved);
+            return -1;
+        }
+
+        /* The medians need every element labelled, so elements the seeding
+         * left at -1 join the closest center first */
+        for (i = 0; i < nelements; i++)
+            if (tclusterid[i] < 0)
+                break;
+        if (i < nelements)
+            seedcentroids (nelements, ndata, data, mask, tclusterid, cdata, cmask, transpose);
+        for (; i < nelements; i++) {
+            double distance = DBL_MAX;
+            if (tclusterid[i] >= 0)
+                continue;
+            for (j = 0; j < nclusters; j++) {
+                const double tdistance = metric (ndata, data, cdata, mask, cmask, weight, i, j, transpose);
+                if (tdistance < distance) {
+                    distance = tdistance;
+                    tclusterid[i] = j;
+                }
             }
         }
 
@@ -2715,6 +3409,7 @@ static int kmedians (int nclusters, int nrows, int ncolumns, double **data, int
         /* Start the loop */
         while (1) {
             double previous = total;
+            int moved = 0;
             total = 0.0;
 
             if (counter % period == 0) {        /* Save the current cluster assignments */
@@ -2726,7 +3421,12 @@ static int kmedians (int nclusters, int nrows, int ncolumns, double **data, int
             counter++;
 
             /* Find the center */
-            getclustermedians(nclusters, nrows, ncolumns, data, mask, tclusterid, cdata, cmask, transpose, cache);
+            if (!getclustermedians (nclusters, nrows, ncolumns, data, mask, tclusterid, cdata, cmask, transpose,
+                                    params->eweight, params->nsample, &random, members, start)) {
+                free (order);
+                free (saved);
+                return -1;
+            }
 
             /* Calculate the distances */
             for (i = 0; i < nelements; i++) {
@@ -2741,7 +3441,11 @@ static int kmedians (int nclusters, int nrows, int ncolumns, double **data, int
                     double tdistance;
                     if (j == k)
                         continue;
-                    tdistance = metric (ndata, data, cdata, mask, cmask, weight, i, j, transpose);
+                    if (order)
+                        tdistance = abandondistance (dist, ndata, data, cdata, mask, cmask, weight, i, j,
+                                                     transpose, order, distance * wsum, &skipped);
+                    else
+                        tdistance = metric (ndata, data, cdata, mask, cmask, weight, i, j, transpose);
                     if (tdistance < distance) {
                         distance = tdistance;
                         counts[tclusterid[i]]--;
@@ -2749,10 +3453,15 @@ static int kmedians (int nclusters, int nrows, int ncolumns, double **data, int
                         counts[j]++;
                     }
                 }
-                total += distance;
+                total += params->eweight ? params->eweight[i] * distance : distance;
+                if (tclusterid[i] != k)
+                    moved++;
             }
+            ktraceerror (params->trace, total);
             if (total >= previous)
                 break;
+            if (kconverged (params, counter, previous, total, moved, nelements))
+                break;
             /* total>=previous is FALSE on some machines even if total and previous
              * are bitwise identical. */
             for (i = 0; i < nelements; i++)
@@ -2760,12 +3469,20 @@ static int kmedians (int nclusters, int nrows, int ncolumns, double **data, int
                     break;
             if (i == nelements)
                 break;          /* Identical solution found; break out of this loop */
+            if (npass > 1 && kabandonpass (params, deadline, *error, previous, total, &improvement)) {
+                abandoned = 1;
+                break;          /* This pass cannot beat the best one */
+            }
         }
 
+        ktracepass (params->trace, counter);
+
         if (npass <= 1) {
             *error = total;
             break;
         }
+        if (abandoned)
+            continue;
 
         for (i = 0; i < nclusters; i++)
             mapping[i] = -1;
@@ -2786,12 +3503,302 @@ static int kmedians (int nclusters, int nrows, int ncolumns, double **data, int
         }
         if (i == nelements)
             ifound++;           /* break statement not encountered */
-    } while (++ipass < npass);
+    } while (++ipass < npass && !kstoppasses (params, deadline, ifound));
 
+    if (params->trace)
+        params->trace->skipped += skipped;
+
+    free (order);
     free (saved);
     return ifound;
 }
 
+/* ---------------------------------------------------------------------- */
+
+/*
+The coreset routines perform k-means clustering on a lightweight coreset
+instead of on all elements, as described in:
+
+Olivier Bachem, Mario Lucic and Andreas Krause
+Scalable k-Means Clustering via Lightweight Coresets
+Proceedings of the 24th ACM SIGKDD Conference, 2018, pages 1119-1127.
+
+params->coreset elements are drawn with probability
+q(x) = w(x) / 2W + w(x) d(x) / 2D, where d(x) is the distance from element x to
+the (weighted) mean of all elements, w(x) its weight in params->eweight (1 if
+NULL), and W and D the sums of w and w d. An element drawn h times gets the
+weight h w(x) / (params->coreset q(x)), so that the weighted error of the
+sample estimates the error of all elements. Seeding and every pass of kmeans
+run on the sample only; a final pass assigns each element to the nearest of
+the resulting centroids and computes the error over all elements.
+*/
+
+/* Draws the coreset. Returns the number of distinct elements drawn, stored in
+ * *pmembers with their weights in *psweight, or -1 if out of memory. */
+static int coresetsample (int nrows, int ncolumns, double **data, int **mask, double weight[],
+                          int transpose, char dist, const KParams *params, RandomState *random,
+                          int **pmembers, double **psweight) {
+
+    int i, j, k;
+    const int nelements = (transpose == 0) ? nrows : ncolumns;
+    const int ndata = (transpose == 0) ? ncolumns : nrows;
+    const double *eweight = params->eweight;
+    double (*metric) (int, double **, double **, int **, int **, const double[], int, int, int) = setmetric (dist);
+    double **mdata;
+    int **mmask;
+    double wtotal = 0, dtotal = 0;
+    int nmembers = 0;
+    double *q = malloc (nelements * sizeof (double));
+    int *hits = calloc (nelements, sizeof (int));
+
+    *pmembers = NULL;
+    *psweight = NULL;
+    if (!q || !hits ||
+        (transpose == 0 ? !makedatamask (1, ndata, &mdata, &mmask) : !makedatamask (ndata, 1, &mdata, &mmask))) {
+        free (q);
+        free (hits);
+        return -1;
+    }
+
+    /* The (weighted) mean of all elements, as a single centroid */
+    for (j = 0; j < ndata; j++) {
+        double sum = 0, count = 0;
+        for (i = 0; i < nelements; i++) {
+            const int present = (transpose == 0) ? mask[i][j] : mask[j][i];
+            if (present) {
+                const double w = eweight ? eweight[i] : 1.;
+                sum += w * ((transpose == 0) ? data[i][j] : data[j][i]);
+                count += w;
+            }
+        }
+        if (transpose == 0) {
+            mdata[0][j] = count > 0 ? sum / count : 0.;
+            mmask[0][j] = count > 0;
+        }
+        else {
+            mdata[j][0] = count > 0 ? sum / count : 0.;
+            mmask[j][0] = count > 0;
+        }
+    }
+
+    /* The sampling distribution, as a cumulative sum for select_cumulative. */
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < nelements; i++)
+        q[i] = metric (ndata, data, mdata, mask, mmask, weight, i, 0, transpose);
+    for (i = 0; i < nelements; i++) {
+        const double w = eweight ? eweight[i] : 1.;
+        wtotal += w;
+        dtotal += w * q[i];
+    }
+    for (i = 0; i < nelements; i++) {
+        const double w = eweight ? eweight[i] : 1.;
+        const double p = dtotal > 0 ? 0.5 * w / wtotal + 0.5 * w * q[i] / dtotal : w / wtotal;
+        q[i] = (i > 0 ? q[i - 1] : 0) + p;
+    }
+    if (transpose == 0)
+        freedatamask (1, mdata, mmask);
+    else
+        freedatamask (ndata, mdata, mmask);
+
+    for (k = 0; k < params->coreset; k++)
+        hits[select_cumulative (random, nelements, q)]++;
+    for (i = 0; i < nelements; i++)
+        if (hits[i])
+            nmembers++;
+
+    *pmembers = malloc (nmembers * sizeof (int));
+    *psweight = malloc (nmembers * sizeof (double));
+    if (!*pmembers || !*psweight) {
+        free (*pmembers);
+        free (*psweight);
+        free (q);
+        free (hits);
+        return -1;
+    }
+    for (i = 0, k = 0; i < nelements; i++) {
+        if (hits[i]) {
+            const double p = q[i] - (i > 0 ? q[i - 1] : 0);
+            (*pmembers)[k] = i;
+            (*psweight)[k] = hits[i] * (eweight ? eweight[i] : 1.) / (params->coreset * p);
+            k++;
+        }
+    }
+
+    free (q);
+    free (hits);
+    return nmembers;
+}
+
+/* Assigns every element to the nearest centroid of the clustered coreset and
+ * returns the error over all elements in *error. Returns 0 if out of memory. */
+static int coresetassign (int nclusters, int nrows, int ncolumns, double **data, int **mask, double weight[],
+                          int transpose, char dist, const double eweight[], int nmembers, double **sdata,
+                          int **smask, const int sclusterid[], const double sweight[], int clusterid[],
+                          double *error) {
+
+    int i, j;
+    const int nelements = (transpose == 0) ? nrows : ncolumns;
+    const int ndata = (transpose == 0) ? ncolumns : nrows;
+    double (*metric) (int, double **, double **, int **, int **, const double[], int, int, int) = setmetric (dist);
+    double **cdata;
+    int **cmask;
+    double total = 0;
+    double *csum = malloc (nclusters * ndata * sizeof (double));
+    int *ccount = malloc (nclusters * ndata * sizeof (int));
+    double *cweight = malloc (nclusters * ndata * sizeof (double));
+    double *cost = malloc (nelements * sizeof (double));
+
+    if (!csum || !ccount || !cweight || !cost ||
+        (transpose == 0 ? !makedatamask (nclusters, ndata, &cdata, &cmask)
+                        : !makedatamask (ndata, nclusters, &cdata, &cmask))) {
+        free (csum);
+        free (ccount);
+        free (cweight);
+        free (cost);
+        return 0;
+    }
+
+    if (transpose == 0)
+        getclustersums (nclusters, nmembers, ncolumns, sdata, smask, (int *) sclusterid, sweight,
+                        csum, ccount, cweight, transpose);
+    else
+        getclustersums (nclusters, nrows, nmembers, sdata, smask, (int *) sclusterid, sweight,
+                        csum, ccount, cweight, transpose);
+    getclustermeansfromsums (nclusters, ndata, csum, ccount, cweight, cdata, cmask, transpose);
+
+    #pragma omp parallel for private(j) schedule(static)
+    for (i = 0; i < nelements; i++) {
+        double distance = DBL_MAX;
+        for (j = 0; j < nclusters; j++) {
+            const double tdistance = metric (ndata, data, cdata, mask, cmask, weight, i, j, transpose);
+            if (tdistance < distance) {
+                distance = tdistance;
+                clusterid[i] = j;
+            }
+        }
+        cost[i] = eweight ? eweight[i] * distance : distance;
+    }
+    /* Summed in element order, so that the error does not depend on the number of threads */
+    for (i = 0; i < nelements; i++)
+        total += cost[i];
+    *error = total;
+
+    if (transpose == 0)
+        freedatamask (nclusters, cdata, cmask);
+    else
+        freedatamask (ndata, cdata, cmask);
+    free (csum);
+    free (ccount);
+    free (cweight);
+    free (cost);
+    return 1;
+}
+
+/* k-means on a coreset of params->coreset draws, with the arguments of
+ * kcluster. If npass==0, the coreset starts from the assignment of its
+ * elements in clusterid, with clusters that drew no element taking over an
+ * element of the largest cluster. If fewer distinct elements than clusters are
+ * drawn, all elements are clustered instead, from clusterid itself if npass==0. */
+static void kcoreset (int nclusters, int nrows, int ncolumns, double **data, int **mask,
+                      double weight[], int transpose, int npass, char dist,
+                      int clusterid[], double *error, int *ifound, int assign, const KParams *params) {
+
+    int j, k;
+    const int ndata = (transpose == 0) ? ncolumns : nrows;
+    RandomState random;
+    KParams core = *params;
+    int *counts = NULL;
+    double **sdata = NULL;
+    int **smask = NULL;
+    int *members, *sclusterid;
+    double *sweight;
+    int nmembers;
+
+    *ifound = -1;
+    core.coreset = 0;
+
+    randomseed (&random, params->seed);
+    nmembers = coresetsample (nrows, ncolumns, data, mask, weight, transpose, dist, params, &random,
+                              &members, &sweight);
+    if (nmembers < 0)
+        return;
+    if (nmembers < nclusters) {
+        free (members);
+        free (sweight);
+        kcluster (nclusters, nrows, ncolumns, data, mask, weight, transpose, npass, 'a', dist,
+                  clusterid, error, ifound, assign, &core);
+        return;
+    }
+
+    sclusterid = malloc (nmembers * sizeof (int));
+    if (sclusterid && npass == 0) {
+        /* kcluster takes sclusterid as the initial assignment */
+        counts = calloc (nclusters, sizeof (int));
+        if (!counts) {
+            free (sclusterid);
+            sclusterid = NULL;
+        }
+        else {
+            for (k = 0; k < nmembers; k++)
+                counts[sclusterid[k] = clusterid[members[k]]]++;
+            for (j = 0; j < nclusters; j++) {
+                int largest = 0;
+                if (counts[j])
+                    continue;
+                for (k = 1; k < nmembers; k++)
+                    if (counts[sclusterid[k]] > counts[sclusterid[largest]])
+                        largest = k;
+                counts[sclusterid[largest]]--;
+                sclusterid[largest] = j;
+                counts[j]++;
+            }
+            free (counts);
+        }
+    }
+
+    /* The coreset shares the rows of data; columns have to be copied */
+    if (sclusterid && transpose == 0) {
+        sdata = malloc (nmembers * sizeof (double *));
+        smask = malloc (nmembers * sizeof (int *));
+        if (sdata && smask) {
+            for (k = 0; k < nmembers; k++) {
+                sdata[k] = data[members[k]];
+                smask[k] = mask[members[k]];
+            }
+        }
+    }
+    else if (sclusterid && makedatamask (ndata, nmembers, &sdata, &smask)) {
+        for (j = 0; j < ndata; j++) {
+            for (k = 0; k < nmembers; k++) {
+                sdata[j][k] = data[j][members[k]];
+                smask[j][k] = mask[j][members[k]];
+            }
+        }
+    }
+
+    if (sdata && smask) {
+        /* Cluster the coreset, with random numbers from a seed of its own */
+        core.eweight = sweight;
+        core.seed = (uint64_t) (uniform (&random) * 9007199254740992.0);
+        kcluster (nclusters, transpose == 0 ? nmembers : nrows, transpose == 0 ? ncolumns : nmembers,
+                  sdata, smask, weight, transpose, npass, 'a', dist, sclusterid, error, ifound, assign, &core);
+        if (*ifound > 0 && !coresetassign (nclusters, nrows, ncolumns, data, mask, weight, transpose, dist,
+                                           params->eweight, nmembers, sdata, smask, sclusterid, sweight,
+                                           clusterid, error))
+            *ifound = -1;
+    }
+
+    if (transpose == 0) {
+        free (sdata);
+        free (smask);
+    }
+    else if (sdata)
+        freedatamask (ndata, sdata, smask);
+    free (sclusterid);
+    free (members);
+    free (sweight);
+}
+
 /* ********************************************************************* */
 
 /*
@@ -2874,15 +3881,50 @@ number of clusters is larger than the number of elements being clustered,
 *ifound is set to -1.
 
 assign     (input) int
-The method of initialisation. 0 - default random, 1 - kmeans++ weighted randomized, 2 - spreadout centers
+The method of initialisation. 0 - default random, 1 - kmeans++ weighted randomized (greedy over
+params->candidates draws per center if more than 1), 2 - spreadout centers,
+3 - k-means|| (kmeans++ over about 2*nclusters candidates drawn in each of 5 parallel rounds),
+4 - AFK-MC2 (kmeans++ approximated by Markov chains of params->chain points, 200 if 0),
+5 - PCA-part (the cluster with the largest sum of squared deviations is split in turn by
+projecting its elements on its principal axis and cutting the projections where the two
+sides have the smallest sum of squared deviations). PCA-part is deterministic, so npass > 1
+is reduced to a single pass.
+
+params     (input) KParams*
+Optional convergence control, see cluster.h. Each pass stops when the error no
+longer decreases, when the solution cycles, or earlier when the relative error
+improvement drops below params->tolerance, when fewer than params->moved of the
+elements change cluster, or after params->maxiter iterations. If params->trace
+is not NULL, the iterations and errors of every pass are recorded in it.
+If params is NULL, passes run until the solution stops improving. For k-medians,
+params->nsample > 0 approximates the median of larger clusters from nsample
+members drawn at random, see getclustermedians for the error bound. For
+Euclidean and city-block distances with at least 512 dimensions (or any number
+if params->prune > 0, never if params->prune < 0), distances to candidate
+centroids are abandoned as soon as they exceed the nearest one found so far;
+the number of skipped dimension terms is added to params->trace->skipped.
+Random numbers are drawn from a generator seeded with params->seed, each pass
+from its own stream, so the same seed reproduces the result. params->eweight
+optionally gives each element a weight in the centroids (weighted means or
+medians), the error and kmeans++-style seeding, so that an element with weight
+w counts as w copies of it. For k-means, params->coreset > 0 clusters a
+lightweight coreset of that many weighted draws instead of all elements (see
+kcoreset).
+With npass > 1, no further passes are started once the optimal solution has been
+found params->repeats times, or once params->budget seconds have passed, in
+which case an unfinished pass is abandoned. If params->abort is set, a pass is
+also abandoned once its error is clearly not going to drop below the best error
+of the earlier passes. Abandoned passes do not count towards ifound.
 
 ========================================================================
 */
 void kcluster (int nclusters, int nrows, int ncolumns,
                double **data, int **mask, double weight[], int transpose,
                int npass, char method, char dist,
-               int clusterid[], double *error, int *ifound, int assign) {
+               int clusterid[], double *error, int *ifound, int assign, const KParams *params) {
 
+    const KParams defaults = {0};
+    RandomState random;
     const int nelements = (transpose == 0) ? nrows : ncolumns;
     const int ndata = (transpose == 0) ? ncolumns : nrows;
 
@@ -2902,6 +3944,17 @@ void kcluster (int nclusters, int nrows, int ncolumns,
 
     *ifound = -1;
 
+    if (!params)
+        params = &defaults;
+    if (assign == 5 && npass > 1)
+        npass = 1;
+    if (method != 'm' && params->coreset > 0 && params->coreset < nelements) {
+        kcoreset (nclusters, nrows, ncolumns, data, mask, weight, transpose, npass, dist,
+                  clusterid, error, ifound, assign, params);
+        return;
+    }
+    randomseed (&random, params->seed);
+
     /* This will contain the number of elements in each cluster, which is
      * needed to check for empty clusters. */
     counts = malloc (nclusters * sizeof (int));
@@ -2942,18 +3995,19 @@ void kcluster (int nclusters, int nrows, int ncolumns,
     }
 
     if (method == 'm') {
-        double *cache = malloc (nelements * sizeof (double));
-        if (cache) {
+        int *order = malloc (nelements * sizeof (int));
+        int *start = malloc ((nclusters + 1) * sizeof (int));
+        if (order && start)
             *ifound = kmedians (nclusters, nrows, ncolumns, data, mask, weight,
                                 transpose, npass, dist, cdata, cmask, clusterid,
-                                error, tclusterid, counts, mapping, cache, assign);
-            free (cache);
-        }
+                                error, tclusterid, counts, mapping, order, start, assign, params, random);
+        free (order);
+        free (start);
     }
     else
         *ifound = kmeans (nclusters, nrows, ncolumns, data, mask, weight,
                           transpose, npass, dist, cdata, cmask, clusterid,
-                          error, tclusterid, counts, mapping, assign);
+                          error, tclusterid, counts, mapping, assign, params, random);
 
     /* Deallocate temporarily used space */
     if (npass > 1) {
@@ -2990,11 +4044,9 @@ The number of clusters to be found.
 nelements  (input) int
 The number of elements to be clustered.
 
-distmatrix (input) double array, ragged
-  (number of rows is nelements, number of columns is equal to the row number)
-The distance matrix. To save space, the distance matrix is given in the
-form of a ragged array. The distance matrix is symmetric and has zeros
-on the diagonal. See distancematrix for a description of the content.
+distmatrix (input) DistanceMatrix*
+The distance matrix between the nelements elements. To save space, only the
+lower triangle is stored, see distancematrix.
 
 npass      (input) int
 The number of times clustering is performed. Clustering is performed npass
@@ -3024,10 +4076,14 @@ was found. The value of ifound is at least 1; its maximum value is npass.
 If the user requested more clusters than elements available, ifound is set
 to 0. If kmedoids fails due to a memory allocation error, ifound is set to -1.
 
+seed       (input) uint64_t
+The seed of the random number generator used for the initial assignments, see
+randomseed.
+
 ========================================================================
 */
-void kmedoids (int nclusters, int nelements, double **distmatrix, int npass,
-               int clusterid[], double *error, int *ifound) {
+void kmedoids (int nclusters, int nelements, const DistanceMatrix *distmatrix, int npass,
+               int clusterid[], double *error, int *ifound, uint64_t seed) {
 
     int i, j, icluster;
     int *tclusterid;
@@ -3035,6 +4091,7 @@ void kmedoids (int nclusters, int nelements, double **distmatrix, int npass,
     int *centroids;
     double *errors;
     int ipass = 0;
+    RandomState stream;
 
     if (nelements < nclusters) {
         *ifound = 0;
@@ -3074,14 +4131,18 @@ void kmedoids (int nclusters, int nelements, double **distmatrix, int npass,
         }
     }
 
+    randomseed (&stream, seed);
     *error = DBL_MAX;
     do {                        /* Start the loop */
         double total = DBL_MAX;
         int counter = 0;
         int period = 10;
 
+        RandomState random = stream;
+        randomjump (&stream);
+
         if (npass != 0)
-            randomassign (nclusters, nelements, tclusterid);
+            randomassign (&random, nclusters, nelements, tclusterid);
         while (1) {
             double previous = total;
             total = 0.0;
@@ -3108,7 +4169,7 @@ void kmedoids (int nclusters, int nelements, double **distmatrix, int npass,
                         tclusterid[i] = icluster;
                         break;
                     }
-                    tdistance = (i > j) ? distmatrix[i][j] : distmatrix[j][i];
+                    tdistance = getdistance (distmatrix, i, j);
                     if (tdistance < distance) {
                         distance = tdistance;
                         tclusterid[i] = icluster;
@@ -3160,41 +4221,139 @@ void kmedoids (int nclusters, int nelements, double **distmatrix, int npass,
 Purpose
 =======
 
-The distancematrix routine calculates the distance matrix between genes or
-microarrays using their measured gene expression data. Several distance measures
-can be used. The routine returns a pointer to a ragged array containing the
-distances between the genes. As the distance matrix is symmetric, with zeros on
-the diagonal, only the lower triangular half of the distance matrix is saved.
-The distancematrix routine allocates space for the distance matrix. If the
-parameter transpose is set to a nonzero value, the distances between the columns
-(microarrays) are calculated, otherwise distances between the rows (genes) are
-calculated.
-If sufficient space in memory cannot be allocated to store the distance matrix,
-the routine returns a NULL pointer, and all memory allocated so far for the
-distance matrix is freed.
+The silhouette routine calculates the silhouette of each element in a
+clustering solution, given the distance matrix:
+
+Peter J. Rousseeuw
+Silhouettes: a graphical aid to the interpretation and validation of cluster
+analysis
+Journal of Computational and Applied Mathematics, 20, 1987, pages 53-65.
 
+For an element i, a is the average distance to the other elements in its
+cluster and b the smallest average distance to the elements of another cluster.
+The silhouette (b-a)/max(a,b) lies between -1 and 1, and is close to 1 for
+elements that are well inside their cluster. Elements that are alone in their
+cluster, or for which there are no other clusters, have a silhouette of 0.
 
 Arguments
 =========
 
-nrows      (input) int
-The number of rows in the gene expression data matrix (i.e., the number of
-genes)
+nclusters  (input) int
+The number of clusters.
 
-ncolumns   (input) int
-The number of columns in the gene expression data matrix (i.e., the number of
-microarrays)
+distmatrix (input) const DistanceMatrix*
+The distance matrix between the elements, see distancematrix.
 
-data       (input) double[nrows][ncolumns]
-The array containing the gene expression data.
+clusterid  (input) int[nelements]
+The cluster number, between 0 and nclusters-1, to which each element belongs.
 
-mask       (input) int[nrows][ncolumns]
-This array shows which data values are missing. If mask[i][j]==0, then
-data[i][j] is missing.
+values     (output) double[nelements]
+The silhouette of each element.
 
-weight (input) double[n]
-The weights that are used to calculate the distance. The length of this vector
-is equal to the number of columns if the distances between genes are calculated,
+score      (output) double*
+The average silhouette of the elements.
+
+Return value
+============
+
+1 on success, 0 if a memory error occurs.
+
+========================================================================
+*/
+int silhouette (int nclusters, const DistanceMatrix *distmatrix, const int clusterid[],
+                double values[], double *score) {
+
+    int i;
+    int failed = 0;
+    double total = 0.;
+    const int nelements = distmatrix->n;
+    int *count = calloc (nclusters, sizeof (int));
+    if (!count)
+        return 0;
+    for (i = 0; i < nelements; i++)
+        count[clusterid[i]]++;
+
+    #pragma omp parallel reduction(|:failed)
+    {
+        double *sum = malloc (nclusters * sizeof (double));
+        int j;
+        if (!sum)
+            failed = 1;
+
+        #pragma omp for schedule(dynamic, 16)
+        for (i = 0; i < nelements; i++) {
+            const int icluster = clusterid[i];
+            double a, b = DBL_MAX;
+            if (!sum)
+                continue;
+            for (j = 0; j < nclusters; j++)
+                sum[j] = 0.;
+            for (j = 0; j < nelements; j++)
+                if (j != i)
+                    sum[clusterid[j]] += getdistance (distmatrix, i, j);
+            for (j = 0; j < nclusters; j++)
+                if (j != icluster && count[j] > 0 && sum[j] / count[j] < b)
+                    b = sum[j] / count[j];
+            if (count[icluster] < 2 || b == DBL_MAX)
+                values[i] = 0.;
+            else {
+                a = sum[icluster] / (count[icluster] - 1);
+                values[i] = (a < b) ? 1. - a / b : (a > b) ? b / a - 1. : 0.;
+            }
+        }
+        free (sum);
+    }
+
+    free (count);
+    if (failed)
+        return 0;
+    for (i = 0; i < nelements; i++)
+        total += values[i];
+    *score = (nelements > 0) ? total / nelements : 0.;
+    return 1;
+}
+
+/* ******************************************************************** */
+
+/*
+Purpose
+=======
+
+The distancematrix routine calculates the distance matrix between genes or
+microarrays using their measured gene expression data. Several distance measures
+can be used. The routine returns a pointer to a DistanceMatrix struct containing
+the distances between the genes. As the distance matrix is symmetric, with zeros
+on the diagonal, only the lower triangular half of the distance matrix is saved,
+row after row in a single buffer (see src/cluster.h). The distancematrix routine
+allocates space for the distance matrix, which should be deallocated by the
+calling routine with freedistancematrix. If the parameter transpose is set to a
+nonzero value, the distances between the columns (microarrays) are calculated,
+otherwise distances between the rows (genes) are calculated.
+If sufficient space in memory cannot be allocated to store the distance matrix,
+the routine returns a NULL pointer.
+
+
+Arguments
+=========
+
+nrows      (input) int
+The number of rows in the gene expression data matrix (i.e., the number of
+genes)
+
+ncolumns   (input) int
+The number of columns in the gene expression data matrix (i.e., the number of
+microarrays)
+
+data       (input) double[nrows][ncolumns]
+The array containing the gene expression data.
+
+mask       (input) int[nrows][ncolumns]
+This array shows which data values are missing. If mask[i][j]==0, then
+data[i][j] is missing.
+
+weight (input) double[n]
+The weights that are used to calculate the distance. The length of this vector
+is equal to the number of columns if the distances between genes are calculated,
 or the number of rows if the distances between microarrays are calculated.
 
 dist       (input) char
@@ -3215,16 +4374,29 @@ calculated. Otherwise, the distances between the columns is calculated.
 The former is needed when genes are being clustered; the latter is used
 when microarrays are being clustered.
 
+precision  (input) char
+Defines how the distances are stored:
+precision=='f': as float, which halves the memory needed
+For other values of precision, the distances are stored as double.
+
+directory  (input) const char*
+If NULL, the distance matrix is held in memory. Otherwise it is stored in a
+memory-mapped temporary file in this directory, or in the default directory for
+temporary files if it is "". The file is deleted when the matrix is freed.
+Such a matrix is stored in tiles (see src/cluster.h), so that the columns the
+linkage routines read take as few pages as the rows.
+
 ========================================================================
 */
-double** distancematrix (int nrows, int ncolumns, double **data,
-                         int **mask, double weights[], char dist, int transpose) {
+DistanceMatrix* distancematrix (int nrows, int ncolumns, double **data,
+                                int **mask, double weights[], char dist, int transpose,
+                                char precision, const char *directory) {
 
     /* First determine the size of the distance matrix */
     const int n = (transpose == 0) ? nrows : ncolumns;
     const int ndata = (transpose == 0) ? ncolumns : nrows;
     int i, j;
-    double **matrix;
+    DistanceMatrix *matrix;
 
     /* Set the metric function as indicated by dist */
     double (*metric)(int, double **, double **, int **, int **, const double[], int, int, int) = setmetric (dist);
@@ -3232,32 +4404,157 @@ double** distancematrix (int nrows, int ncolumns, double **data,
     if (n < 2)
         return NULL;
 
-    /* Set up the ragged array */
-    matrix = malloc (n * sizeof (double *));
+    matrix = newdistancematrix (n, precision, directory);
     if (matrix == NULL)
         return NULL;            /* Not enough memory available */
-    matrix[0] = NULL;
-    /* The zeroth row has zero columns. We allocate it anyway for convenience. */
-    for (i = 1; i < n; i++) {
-        matrix[i] = malloc (i * sizeof (double));
-        if (matrix[i] == NULL)
-            break;              /* Not enough memory available */
-    }
-    if (i < n) {                /* break condition encountered */
-        j = i;
-        for (i = 1; i < j; i++)
-            free (matrix[i]);
-        return NULL;
-    }
 
-    /* Calculate the distances and save them in the ragged array */
+    /* Calculate the distances and save them row after row. Rows grow longer,
+     * so they are handed out dynamically. */
+    #pragma omp parallel for private(j) schedule(dynamic, 16)
     for (i = 1; i < n; i++)
         for (j = 0; j < i; j++)
-            matrix[i][j] = metric(ndata, data, data, mask, mask, weights, i, j, transpose);
+            setdistance (matrix, i, j, metric (ndata, data, data, mask, mask, weights, i, j, transpose));
+
+    return matrix;
+}
 
+/* ******************************************************************** */
+
+/* Maps a temporary file of the given size in directory, or in the default
+ * directory for temporary files if directory is "". The file is deleted as
+ * soon as it is mapped (on Windows, when it is unmapped) and, where
+ * posix_fallocate is available, its blocks are reserved up front, so that
+ * running out of disk space is reported here and not as a fault while the
+ * matrix is filled. Returns NULL on failure. */
+static void* maptemporary (size_t bytes, const char *directory) {
+#ifdef WINDOWS
+    char folder[MAX_PATH + 1];
+    char path[MAX_PATH + 1];
+    HANDLE file, mapping;
+    void *values;
+    if (!*directory) {
+        if (!GetTempPathA (sizeof (folder), folder))
+            return NULL;
+        directory = folder;
+    }
+    if (!GetTempFileNameA (directory, "flk", 0, path))
+        return NULL;
+    file = CreateFileA (path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+    mapping = CreateFileMappingA (file, NULL, PAGE_READWRITE, (DWORD) ((uint64_t) bytes >> 32),
+                                  (DWORD) bytes, NULL);
+    values = mapping ? MapViewOfFile (mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes) : NULL;
+    if (mapping)
+        CloseHandle (mapping);
+    CloseHandle (file);
+    return values;
+#else
+    char *path;
+    int fd;
+    void *values;
+    if (!*directory) {
+        directory = getenv ("TMPDIR");
+        if (!directory || !*directory)
+            directory = "/tmp";
+    }
+    if ((off_t) bytes < 0 || (size_t) (off_t) bytes != bytes)
+        return NULL;
+    path = malloc (strlen (directory) + sizeof ("/flockXXXXXX"));
+    if (!path)
+        return NULL;
+    strcpy (path, directory);
+    strcat (path, "/flockXXXXXX");
+    fd = mkstemp (path);
+    if (fd >= 0)
+        unlink (path);
+    free (path);
+    if (fd < 0)
+        return NULL;
+#ifdef HAVE_POSIX_FALLOCATE
+    if (posix_fallocate (fd, 0, (off_t) bytes) != 0) {
+#else
+    /* Without posix_fallocate (macOS) the file is sparse, and a full disk only
+     * shows up as a fault while the matrix is filled */
+    if (ftruncate (fd, (off_t) bytes) != 0) {
+#endif
+        close (fd);
+        return NULL;
+    }
+    values = mmap (NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    return (values == MAP_FAILED) ? NULL : values;
+#endif
+}
+
+/* Allocates an uninitialized distance matrix between n elements, storing the
+ * distances as float if precision is 'f' and as double otherwise, in memory if
+ * directory is NULL and in tiles in a memory-mapped temporary file otherwise. Returns
+ * NULL if out of memory or if the file cannot be created. */
+DistanceMatrix* newdistancematrix (int n, char precision, const char *directory) {
+    DistanceMatrix *matrix;
+    const size_t size = (precision == 'f') ? sizeof (float) : sizeof (double);
+    const size_t count = distancecount (n, directory != NULL);
+
+    if (n < 0 || count > SIZE_MAX / size)
+        return NULL;
+    matrix = malloc (sizeof (DistanceMatrix));
+    if (!matrix)
+        return NULL;
+    matrix->n = n;
+    matrix->precision = (precision == 'f') ? 'f' : 'd';
+    matrix->blocked = (directory != NULL);
+    matrix->mapped = directory ? count * size : 0;
+    matrix->values = directory ? maptemporary (count * size, directory) : malloc (count * size);
+    if (!matrix->values) {
+        free (matrix);
+        return NULL;
+    }
     return matrix;
 }
 
+/* Offset of the distance between elements i and j, i != j, in the tiles of a
+ * blocked distance matrix: the tiles of the lower triangle row after row, and
+ * the distances in each tile row after row. */
+static size_t blockoffset (int i, int j) {
+    size_t ib, jb;
+    if (i < j) {
+        const int k = i;
+        i = j;
+        j = k;
+    }
+    ib = (unsigned) i / DISTANCEBLOCK;
+    jb = (unsigned) j / DISTANCEBLOCK;
+    return ((ib * (ib + 1) / 2 + jb) * DISTANCEBLOCK + (unsigned) i % DISTANCEBLOCK) * DISTANCEBLOCK
+           + (unsigned) j % DISTANCEBLOCK;
+}
+
+double getblockdistance (const DistanceMatrix *matrix, int i, int j) {
+    return distancevalue (matrix, blockoffset (i, j));
+}
+
+void setblockdistance (DistanceMatrix *matrix, int i, int j, double value) {
+    if (matrix->precision == 'f')
+        ((float *) matrix->values)[blockoffset (i, j)] = (float) value;
+    else
+        ((double *) matrix->values)[blockoffset (i, j)] = value;
+}
+
+void freedistancematrix (DistanceMatrix *matrix) {
+    if (!matrix)
+        return;
+    if (!matrix->mapped)
+        free (matrix->values);
+    else
+#ifdef WINDOWS
+        UnmapViewOfFile (matrix->values);
+#else
+        munmap (matrix->values, matrix->mapped);
+#endif
+    free (matrix);
+}
+
 /* ******************************************************************** */
 
 /*
@@ -3445,6 +4742,145 @@ void cuttree (int nelements, Node * tree, int nclusters, int clusterid[]) {
 
 /* ******************************************************************** */
 
+/*
+Purpose
+=======
+
+The cutdistance routine divides the elements in the tree structure produced by
+a hierarchical clustering routine into clusters, by undoing every link at a
+distance above a threshold. As the distances of centroid linkage need not
+increase towards the root, a link is undone if its distance or that of any
+link below it exceeds the threshold, so that the clusters are always subtrees.
+
+Arguments
+=========
+
+nelements      (input) int
+The number of elements that were clustered.
+
+tree           (input) Node[nelements-1]
+The clustering solution, see cuttree.
+
+threshold      (input) double
+Links at a distance above threshold are undone.
+
+clusterid      (output) int[nelements]
+The number of the cluster to which each element was assigned. Space for this
+array should be allocated before calling the cutdistance routine. If a memory
+error occured, all elements in clusterid are set to -1.
+
+Return value
+============
+
+The number of clusters formed, or 0 if a memory error occured.
+
+========================================================================
+*/
+int cutdistance (int nelements, const Node *tree, double threshold, int clusterid[]) {
+
+    int i, j, k;
+    int icluster = 0;
+    const int nnodes = nelements - 1;
+    double *height;
+    int *nodeid;
+
+    if (nelements < 2) {
+        for (i = 0; i < nelements; i++)
+            clusterid[i] = icluster++;
+        return icluster;
+    }
+    height = malloc (nnodes * sizeof (double));
+    nodeid = malloc (nnodes * sizeof (int));
+    if (!height || !nodeid) {
+        free (height);
+        free (nodeid);
+        for (i = 0; i < nelements; i++)
+            clusterid[i] = -1;
+        return 0;
+    }
+
+    /* The largest distance of each node and the nodes below it */
+    for (i = 0; i < nnodes; i++) {
+        height[i] = tree[i].distance;
+        k = tree[i].left;
+        if (k < 0 && height[-k - 1] > height[i])
+            height[i] = height[-k - 1];
+        k = tree[i].right;
+        if (k < 0 && height[-k - 1] > height[i])
+            height[i] = height[-k - 1];
+        nodeid[i] = -1;
+    }
+
+    /* Top down, each kept node passes its cluster to its children, and each
+     * undone node starts a new cluster for every child */
+    for (i = nnodes - 1; i >= 0; i--) {
+        const int children[2] = {tree[i].left, tree[i].right};
+        if (height[i] <= threshold && nodeid[i] < 0)
+            nodeid[i] = icluster++;
+        for (j = 0; j < 2; j++) {
+            k = children[j];
+            if (height[i] <= threshold) {
+                if (k < 0)
+                    nodeid[-k - 1] = nodeid[i];
+                else
+                    clusterid[k] = nodeid[i];
+            }
+            else if (k >= 0)
+                clusterid[k] = icluster++;
+        }
+    }
+
+    free (height);
+    free (nodeid);
+    return icluster;
+}
+
+/* ******************************************************************** */
+
+/*
+This function finds the nearest neighbor of element i among the elements j < i,
+which is the row of i in the condensed distance matrix. Of equal distances the
+lowest j is taken, so that the cached neighbors of all rows yield the same pair
+as a full scan of the distance matrix. The distance is returned in dp.
+*/
+
+static int nearest_in_row (const DistanceMatrix *distmatrix, int i, double *dp) {
+    int j;
+    int nearest = 0;
+    const size_t offset = distanceoffset (i, 0);
+    double distance = getdistance (distmatrix, i, 0);
+    for (j = 1; j < i; j++) {
+        const double temp = distmatrix->blocked ? getdistance (distmatrix, i, j)
+                                                : distancevalue (distmatrix, offset + j);
+        if (temp < distance) {
+            distance = temp;
+            nearest = j;
+        }
+    }
+    *dp = distance;
+    return nearest;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+This function updates the cached nearest neighbor of row i after the distance
+to element j < i changed to distance. The row is only searched again if its
+cached neighbor was j and moved away.
+*/
+
+static void update_nearest (const DistanceMatrix *distmatrix, int i, int j, double distance,
+                            int nearest[], double nearestdistance[]) {
+    if (nearest[i] == j && distance > nearestdistance[i])
+        nearest[i] = nearest_in_row (distmatrix, i, &nearestdistance[i]);
+    else if (distance < nearestdistance[i] || (distance == nearestdistance[i] && j <= nearest[i])) {
+        nearest[i] = j;
+        nearestdistance[i] = distance;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
 /*
 
 Purpose
@@ -3452,6 +4888,10 @@ Purpose
 
 The pclcluster routine performs clustering using pairwise centroid-linking
 on a given set of gene expression data, using the distance metric given by dist.
+The nearest neighbor of every row of the distance matrix is cached, so that the
+closest pair is found by scanning one value per node; after a merge only the
+rows whose cached neighbor is invalidated are searched again. The distances to
+each new centroid are calculated in parallel.
 
 Arguments
 =========
@@ -3493,10 +4933,15 @@ dist=='s': Spearman's rank correlation
 dist=='k': Kendall's tau
 For other values of dist, the default (Euclidean distance) is used.
 
-distmatrix (input) double**
+distmatrix (input) DistanceMatrix*
 The distance matrix. This matrix is precalculated by the calling routine
 treecluster. The pclcluster routine modifies the contents of distmatrix, but
-does not deallocate it.
+does not deallocate it. The distances between merged nodes are stored in the
+precision of distmatrix.
+
+nmerges    (input) int
+The number of merges to make, nelements-1 for the full tree. Fewer merges leave
+nelements-nmerges clusters, the same as cutting the full tree there.
 
 Return value
 ============
@@ -3510,7 +4955,8 @@ If a memory error occurs, pclcluster returns NULL.
 ========================================================================
 */
 static Node* pclcluster (int nrows, int ncolumns, double **data, int **mask,
-                         double weight[], double **distmatrix, char dist, int transpose) {
+                         double weight[], DistanceMatrix *distmatrix, char dist, int transpose,
+                         int nmerges) {
 
     int i, j;
     const int nelements = (transpose == 0) ? nrows : ncolumns;
@@ -3524,15 +4970,24 @@ static Node* pclcluster (int nrows, int ncolumns, double **data, int **mask,
     Node *result;
     double **newdata;
     int **newmask;
+    int *nearest;
+    double *nearestdistance;
     int *distid = malloc (nelements * sizeof (int));
     if (!distid)
         return NULL;
     result = malloc (nnodes * sizeof (Node));
-    if (!result) {
+    nearest = malloc (nelements * sizeof (int));
+    nearestdistance = malloc (nelements * sizeof (double));
+    if (!result || !nearest || !nearestdistance) {
+        free (nearestdistance);
+        free (nearest);
+        free (result);
         free (distid);
         return NULL;
     }
     if (!makedatamask (nelements, ndata, &newdata, &newmask)) {
+        free (nearestdistance);
+        free (nearest);
         free (result);
         free (distid);
         return NULL;
@@ -3562,10 +5017,18 @@ static Node* pclcluster (int nrows, int ncolumns, double **data, int **mask,
         mask = newmask;
     }
 
-    for (inode = 0; inode < nnodes; inode++) {  /* Find the pair with the shortest distance */
+    for (i = 1; i < nelements; i++)
+        nearest[i] = nearest_in_row (distmatrix, i, &nearestdistance[i]);
+
+    for (inode = 0; inode < nmerges; inode++) { /* Find the pair with the shortest distance */
+        const int last = nnodes - inode;
         int is = 1;
         int js = 0;
-        result[inode].distance = find_closest_pair (nelements - inode, distmatrix, &is, &js);
+        for (i = 2; i <= last; i++)
+            if (nearestdistance[i] < nearestdistance[is])
+                is = i;
+        js = nearest[is];
+        result[inode].distance = nearestdistance[is];
         result[inode].left = distid[js];
         result[inode].right = distid[is];
 
@@ -3578,28 +5041,46 @@ static Node* pclcluster (int nrows, int ncolumns, double **data, int **mask,
         }
         free (data[is]);
         free (mask[is]);
-        data[is] = data[nnodes - inode];
-        mask[is] = mask[nnodes - inode];
+        data[is] = data[last];
+        mask[is] = mask[last];
 
         /* Fix the distances */
-        distid[is] = distid[nnodes - inode];
-        for (i = 0; i < is; i++)
-            distmatrix[is][i] = distmatrix[nnodes - inode][i];
-        for (i = is + 1; i < nnodes - inode; i++)
-            distmatrix[i][is] = distmatrix[nnodes - inode][i];
+        distid[is] = distid[last];
+        for (i = 0; i < last; i++)
+            if (i != is)
+                setdistance (distmatrix, is, i, getdistance (distmatrix, last, i));
 
         distid[js] = -inode - 1;
-        for (i = 0; i < js; i++)
-            distmatrix[js][i] = metric (ndata, data, data, mask, mask, weight, js, i, 0);
-        for (i = js + 1; i < nnodes - inode; i++)
-            distmatrix[i][js] = metric (ndata, data, data, mask, mask, weight, js, i, 0);
+        #pragma omp parallel for schedule(static)
+        for (i = 0; i < last; i++)
+            if (i != js)
+                setdistance (distmatrix, js, i, metric (ndata, data, data, mask, mask, weight, js, i, 0));
+
+        /* Fix the nearest neighbors of the rows that changed or saw a change */
+        #pragma omp parallel for schedule(dynamic, 16)
+        for (i = 1; i < last; i++) {
+            if (i == is || i == js)
+                nearest[i] = nearest_in_row (distmatrix, i, &nearestdistance[i]);
+            else {
+                if (i > is)
+                    update_nearest (distmatrix, i, is, getdistance (distmatrix, i, is),
+                                    nearest, nearestdistance);
+                if (i > js)
+                    update_nearest (distmatrix, i, js, getdistance (distmatrix, i, js),
+                                    nearest, nearestdistance);
+            }
+        }
     }
 
     /* Free temporarily allocated space */
-    free (data[0]);
-    free (mask[0]);
+    for (i = 0; i < nelements - nmerges; i++) {
+        free (data[i]);
+        free (mask[i]);
+    }
     free (data);
     free (mask);
+    free (nearestdistance);
+    free (nearest);
     free (distid);
 
     return result;
@@ -3637,7 +5118,10 @@ cluster method. The Computer Journal, 16(1): 30-34.
 The output of this algorithm is identical to conventional single-linkage
 hierarchical clustering, but is much more memory-efficient and faster. Hence,
 it can be applied to large data sets, for which the conventional single-
-linkage algorithm fails due to lack of memory.
+linkage algorithm fails due to lack of memory. Without a distance matrix, the
+distances from each new element to the elements before it are calculated in
+parallel; the pointer representation itself is updated serially, so the result
+does not depend on the number of threads.
 
 
 Arguments
@@ -3679,7 +5163,7 @@ dist=='s': Spearman's rank correlation
 dist=='k': Kendall's tau
 For other values of dist, the default (Euclidean distance) is used.
 
-distmatrix (input) double**
+distmatrix (input) DistanceMatrix*
 The distance matrix. If the distance matrix is passed by the calling routine
 treecluster, it is used by pslcluster to speed up the clustering calculation.
 The pslcluster routine does not modify the contents of distmatrix, and does
@@ -3703,7 +5187,7 @@ If a memory error occurs, pslcluster returns NULL.
 ========================================================================
 */
 static Node* pslcluster (int nrows, int ncolumns, double **data, int **mask,
-                         double weight[], double **distmatrix, char dist, int transpose) {
+                         double weight[], const DistanceMatrix *distmatrix, char dist, int transpose) {
 
     int i, j, k;
     const int nelements = transpose ? ncolumns : nrows;
@@ -3738,10 +5222,12 @@ static Node* pslcluster (int nrows, int ncolumns, double **data, int **mask,
         vector[i] = i;
 
     if (distmatrix) {
-        for (i = 0; i < nrows; i++) {
+        size_t offset = 0;
+        for (i = 0; i < nelements; i++) {
             result[i].distance = DBL_MAX;
             for (j = 0; j < i; j++)
-                temp[j] = distmatrix[i][j];
+                temp[j] = distmatrix->blocked ? getdistance (distmatrix, i, j)
+                                              : distancevalue (distmatrix, offset++);
             for (j = 0; j < i; j++) {
                 k = vector[j];
                 if (result[j].distance >= temp[j]) {
@@ -3767,26 +5253,33 @@ static Node* pslcluster (int nrows, int ncolumns, double **data, int **mask,
             (int, double **, double **, int **, int **, const double[], int,
            int, int) = setmetric (dist);
 
+        /* One team for all rows: each row computes its distances in parallel
+         * and updates the pointer representation in a single thread */
+        #pragma omp parallel private(i, j, k)
         for (i = 0; i < nelements; i++) {
-            result[i].distance = DBL_MAX;
+            #pragma omp for schedule(static)
             for (j = 0; j < i; j++)
                 temp[j] =
                     metric (ndata, data, data, mask, mask, weight, i, j,
                             transpose);
-            for (j = 0; j < i; j++) {
-                k = vector[j];
-                if (result[j].distance >= temp[j]) {
-                    if (result[j].distance < temp[k])
-                        temp[k] = result[j].distance;
-                    result[j].distance = temp[j];
-                    vector[j] = i;
+            #pragma omp single
+            {
+                result[i].distance = DBL_MAX;
+                for (j = 0; j < i; j++) {
+                    k = vector[j];
+                    if (result[j].distance >= temp[j]) {
+                        if (result[j].distance < temp[k])
+                            temp[k] = result[j].distance;
+                        result[j].distance = temp[j];
+                        vector[j] = i;
+                    }
+                    else if (temp[j] < temp[k])
+                        temp[k] = temp[j];
                 }
-                else if (temp[j] < temp[k])
-                    temp[k] = temp[j];
+                for (j = 0; j < i; j++)
+                    if (result[j].distance >= result[vector[j]].distance)
+                        vector[j] = i;
             }
-            for (j = 0; j < i; j++)
-                if (result[j].distance >= result[vector[j]].distance)
-                    vector[j] = i;
         }
     }
     free (temp);
@@ -3814,85 +5307,395 @@ static Node* pslcluster (int nrows, int ncolumns, double **data, int **mask,
 
 /* ******************************************************************** */
 
-/*
-
-Purpose
-=======
-
-The pmlcluster routine performs clustering using pairwise maximum- (complete-)
-linking on the given distance matrix.
-
-Arguments
-=========
+static const Node *sortnodes = NULL;    /* used to sort the merges of nnchaincluster */
 
-nelements     (input) int
-The number of elements to be clustered.
+/* Orders merges by distance, and merges at equal distances in the order in
+ * which they were made. */
+static int comparenodes (const void *a, const void *b) {
+    const int i1 = *(const int *) a;
+    const int i2 = *(const int *) b;
+    const double term1 = sortnodes[i1].distance;
+    const double term2 = sortnodes[i2].distance;
+    if (term1 < term2)
+        return -1;
+    if (term1 > term2)
+        return +1;
+    return i1 - i2;
+}
 
-distmatrix (input) double**
-The distance matrix, with nelements rows, each row being filled up to the
-diagonal. The elements on the diagonal are not used, as they are assumed to be
-zero. The distance matrix will be modified by this routine.
+static int findroot (int parent[], int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
 
-Return value
-============
+/* Returns 1 if the nmerges closest of the nfound merges made by nnchaincluster
+ * are certain to be the first nmerges of the full solution: as the linkages are
+ * reducible, no later merge is closer than the closest pair of the clusters that
+ * remain (number[i] > 0). active is scratch space for nelements ints. */
+static int nnchainsettled (int nelements, const DistanceMatrix *distmatrix, const int number[],
+                           const Node merges[], int nfound, int nmerges, int active[]) {
+    int i, j;
+    int nactive = 0;
+    int count = 0;
+    double closest = DBL_MAX;
+    for (i = 0; i < nelements; i++)
+        if (number[i])
+            active[nactive++] = i;
+    for (i = 1; i < nactive; i++) {
+        for (j = 0; j < i; j++) {
+            const double distance = getdistance (distmatrix, active[i], active[j]);
+            if (distance < closest)
+                closest = distance;
+        }
+    }
+    for (i = 0; i < nfound; i++)
+        if (merges[i].distance < closest)
+            count++;
+    return count >= nmerges;
+}
 
-A pointer to a newly allocated array of Node structs, describing the
-hierarchical clustering solution consisting of nelements-1 nodes. Depending on
-whether genes (rows) or microarrays (columns) were clustered, nelements is
-equal to nrows or ncolumns. See src/cluster.h for a description of the Node
-structure.
-If a memory error occurs, pmlcluster returns NULL.
-========================================================================
+/*
+The nnchaincluster routine performs pairwise maximum- (method=='m'), average-
+(method=='a') or Ward (method=='w') linkage clustering with the nearest-neighbor
+chain algorithm, in
+O(nelements^2) time instead of the O(nelements^3) of a search for the closest
+pair before every merge:
+
+Fionn Murtagh
+A survey of recent advances in hierarchical clustering algorithms
+The Computer Journal, 26(4), 1983, pages 354-359.
+
+A chain is grown from any cluster by repeatedly stepping to the nearest
+neighbor of its last cluster, until two clusters are each other's nearest
+neighbors; they are merged and the distances to the merged cluster follow from
+the Lance-Williams formula. As these linkages are reducible, every merge found
+this way is one that the closest pair search makes as well, only in a different
+order. The merges are therefore sorted by distance afterwards and numbered the
+way the closest pair search numbers them, in which the distance matrix rows of
+merged clusters are moved as in pmlcluster and palcluster. Merges at exactly
+equal distances may come out in a different order.
+
+If nmerges is less than nelements-1, only the first nmerges merges of the tree
+are returned. The chain then stops as soon as nnchainsettled shows that they
+have all been found, checking about as often as the merges take.
+
+If sizes is not NULL, element i stands for a cluster of sizes[i] elements that
+are weighted accordingly by average and Ward linkage (see microtreecluster).
+
+The distance matrix is modified by this routine. If a memory error occurs,
+nnchaincluster returns NULL.
 */
-static Node* pmlcluster (int nelements, double **distmatrix) {
-
-    int j;
-    int n;
-    int *clusterid;
-    Node *result;
-
-    clusterid = malloc (nelements * sizeof (int));
-    if (!clusterid)
-        return NULL;
-    result = malloc ((nelements - 1) * sizeof (Node));
-    if (!result) {
-        free (clusterid);
+static Node* nnchaincluster (int nelements, DistanceMatrix *distmatrix, char method, int nmerges,
+                             const int sizes[]) {
+
+    int i, j, k, n;
+    int nchain = 0;
+    int first = 0;
+    int nfound = 0;
+    int checked = 0;
+    int *chain = malloc (nelements * sizeof (int));
+    int *number = malloc (nelements * sizeof (int));
+    int *index = malloc (nelements * sizeof (int));
+    int *position = malloc (nelements * sizeof (int));
+    int *label = malloc (nelements * sizeof (int));
+    Node *merges = malloc ((nelements - 1) * sizeof (Node));
+    Node *result = malloc ((nelements - 1) * sizeof (Node));
+
+    if (!chain || !number || !index || !position || !label || !merges || !result) {
+        free (chain);
+        free (number);
+        free (index);
+        free (position);
+        free (label);
+        free (merges);
+        free (result);
         return NULL;
     }
 
-    /* Setup a list specifying to which cluster a gene belongs */
-    for (j = 0; j < nelements; j++)
-        clusterid[j] = j;
+    /* Cluster i is kept in row and column i of the distance matrix, with
+     * number[i] elements; merged clusters are kept in the lower one. */
+    for (i = 0; i < nelements; i++)
+        number[i] = sizes ? sizes[i] : 1;
 
-    for (n = nelements; n > 1; n--) {
-        int is = 1;
-        int js = 0;
-        result[nelements - n].distance = find_closest_pair (n, distmatrix, &is, &js);
+    for (n = 0; n < nelements - 1; n++) {
+        int a, b;
+        double distance;
 
-        /* Fix the distances */
-        for (j = 0; j < js; j++)
-            distmatrix[js][j] = max (distmatrix[is][j], distmatrix[js][j]);
-        for (j = js + 1; j < is; j++)
-            distmatrix[j][js] = max (distmatrix[is][j], distmatrix[j][js]);
-        for (j = is + 1; j < n; j++)
-            distmatrix[j][js] = max (distmatrix[j][is], distmatrix[j][js]);
-
-        for (j = 0; j < is; j++)
-            distmatrix[is][j] = distmatrix[n - 1][j];
-        for (j = is + 1; j < n - 1; j++)
-            distmatrix[j][is] = distmatrix[n - 1][j];
+        if (nchain == 0) {
+            while (!number[first])
+                first++;
+            chain[nchain++] = first;
+        }
+
+        while (1) {
+            a = chain[nchain - 1];
+            /* On ties, step back to the previous cluster so that the chain ends */
+            b = (nchain > 1) ? chain[nchain - 2] : -1;
+            distance = (b < 0) ? 0 : getdistance (distmatrix, a, b);
+            for (k = 0; k < nelements; k++) {
+                double temp;
+                if (k == a || !number[k])
+                    continue;
+                temp = getdistance (distmatrix, a, k);
+                if (b < 0 || temp < distance) {
+                    distance = temp;
+                    b = k;
+                }
+            }
+            if (nchain > 1 && b == chain[nchain - 2])
+                break;
+            chain[nchain++] = b;
+        }
+        nchain -= 2;
+
+        i = (a < b) ? a : b;
+        j = (a < b) ? b : a;
+        merges[n].left = i;
+        merges[n].right = j;
+        merges[n].distance = distance;
+
+        /* Fix the distances */
+        for (k = 0; k < nelements; k++) {
+            double dki, dkj;
+            if (k == i || k == j || !number[k])
+                continue;
+            dki = getdistance (distmatrix, k, i);
+            dkj = getdistance (distmatrix, k, j);
+            if (method == 'm')
+                dki = max (dki, dkj);
+            else if (method == 'w')
+                dki = ((number[i] + number[k]) * dki + (number[j] + number[k]) * dkj - number[k] * distance)
+                      / (number[i] + number[j] + number[k]);
+            else
+                dki = (dki * number[i] + dkj * number[j]) / (number[i] + number[j]);
+            setdistance (distmatrix, k, i, dki);
+        }
+        number[i] += number[j];
+        number[j] = 0;
+        nfound = n + 1;
+
+        if (nfound >= nmerges && nfound < nelements - 1) {
+            const int nactive = nelements - nfound;
+            const long interval = (long) nactive * nactive / nelements;
+            if (nfound - checked >= interval) {
+                checked = nfound;
+                if (nnchainsettled (nelements, distmatrix, number, merges, nfound, nmerges, index))
+                    break;
+            }
+        }
+    }
+
+    /* Replay the merges in order of distance. chain now holds the union-find
+     * parent of each element, and number the element representing the cluster
+     * in each row of the shrinking distance matrix of the closest pair search. */
+    for (n = 0; n < nfound; n++)
+        index[n] = n;
+    sortnodes = merges;
+    qsort (index, nfound, sizeof (int), comparenodes);
+
+    for (i = 0; i < nelements; i++) {
+        chain[i] = i;
+        number[i] = i;
+        position[i] = i;
+        label[i] = i;
+    }
+
+    for (n = 0; n < nmerges; n++) {
+        const Node *merge = &merges[index[n]];
+        const int ra = findroot (chain, merge->left);
+        const int rb = findroot (chain, merge->right);
+        const int is = (position[ra] > position[rb]) ? position[ra] : position[rb];
+        const int js = (position[ra] > position[rb]) ? position[rb] : position[ra];
+        const int last = nelements - n - 1;
+
+        result[n].left = label[number[is]];
+        result[n].right = label[number[js]];
+        result[n].distance = merge->distance;
+
+        number[is] = number[last];
+        position[number[is]] = is;
+
+        chain[rb] = ra;
+        number[js] = ra;
+        position[ra] = js;
+        label[ra] = -n - 1;
+    }
+
+    free (chain);
+    free (number);
+    free (index);
+    free (position);
+    free (label);
+    free (merges);
+
+    return result;
+}
+
+/* ******************************************************************** */
+
+/*
+The pairwisecluster routine performs pairwise maximum- (method=='m'), average-
+(method=='a') or Ward (method=='w') linkage clustering by merging the closest
+pair of clusters again and again, as the original pmlcluster and palcluster
+did. The rows of the distance matrix are kept in the same order, and the
+closest pair is the first one found by a scan of the rows in order, so merges
+at equal distances, which are common for integer or binary data, are made in
+exactly the same order. Instead of a scan of the whole distance matrix before
+each merge, the nearest neighbor of every row is cached and searched again only
+for the rows that the merge invalidates, as in pclcluster.
+
+If nmerges is less than nelements-1, the clustering stops after nmerges merges.
+If sizes is not NULL, element i stands for a cluster of sizes[i] elements, as in
+nnchaincluster.
+
+The distance matrix is modified by this routine. If a memory error occurs,
+pairwisecluster returns NULL.
+*/
+static Node* pairwisecluster (int nelements, DistanceMatrix *distmatrix, char method, int nmerges,
+                              const int sizes[]) {
+
+    int i, j, n;
+    int *clusterid = malloc (nelements * sizeof (int));
+    int *number = malloc (nelements * sizeof (int));
+    int *nearest = malloc (nelements * sizeof (int));
+    double *nearestdistance = malloc (nelements * sizeof (double));
+    Node *result = malloc ((nelements - 1) * sizeof (Node));
+
+    if (!clusterid || !number || !nearest || !nearestdistance || !result) {
+        free (clusterid);
+        free (number);
+        free (nearest);
+        free (nearestdistance);
+        free (result);
+        return NULL;
+    }
+
+    for (j = 0; j < nelements; j++) {
+        number[j] = sizes ? sizes[j] : 1;
+        clusterid[j] = j;
+    }
+    for (i = 1; i < nelements; i++)
+        nearest[i] = nearest_in_row (distmatrix, i, &nearestdistance[i]);
+
+    for (n = nelements; n > nelements - nmerges; n--) {
+        const int last = n - 1;
+        int is = 1;
+        int js;
+        double distance;
+
+        for (i = 2; i < n; i++)
+            if (nearestdistance[i] < nearestdistance[is])
+                is = i;
+        js = nearest[is];
+        distance = nearestdistance[is];
+
+        /* Save result */
+        result[nelements - n].left = clusterid[is];
+        result[nelements - n].right = clusterid[js];
+        result[nelements - n].distance = distance;
+
+        /* Fix the distances */
+        for (j = 0; j < n; j++) {
+            double dis, djs;
+            if (j == is || j == js)
+                continue;
+            dis = getdistance (distmatrix, is, j);
+            djs = getdistance (distmatrix, js, j);
+            if (method == 'm')
+                djs = max (dis, djs);
+            else if (method == 'w')
+                djs = ((number[is] + number[j]) * dis + (number[js] + number[j]) * djs - number[j] * distance)
+                      / (number[is] + number[js] + number[j]);
+            else
+                djs = (dis * number[is] + djs * number[js]) / (number[is] + number[js]);
+            setdistance (distmatrix, js, j, djs);
+        }
+        for (j = 0; j < last; j++)
+            if (j != is)
+                setdistance (distmatrix, is, j, getdistance (distmatrix, last, j));
+
+        /* Update number of elements in the clusters */
+        number[js] += number[is];
+        number[is] = number[last];
+
+        /* Update clusterids */
+        clusterid[js] = n - nelements - 1;
+        clusterid[is] = clusterid[last];
+
+        /* Fix the nearest neighbors of the rows that changed or saw a change */
+        #pragma omp parallel for schedule(dynamic, 16)
+        for (i = 1; i < last; i++) {
+            if (i == is || i == js)
+                nearest[i] = nearest_in_row (distmatrix, i, &nearestdistance[i]);
+            else {
+                if (i > is)
+                    update_nearest (distmatrix, i, is, getdistance (distmatrix, i, is),
+                                    nearest, nearestdistance);
+                if (i > js)
+                    update_nearest (distmatrix, i, js, getdistance (distmatrix, i, js),
+                                    nearest, nearestdistance);
+            }
+        }
+    }
 
-        /* Update clusterids */
-        result[nelements - n].left = clusterid[is];
-        result[nelements - n].right = clusterid[js];
-        clusterid[js] = n - nelements - 1;
-        clusterid[is] = clusterid[n - 1];
-    }
     free (clusterid);
+    free (number);
+    free (nearest);
+    free (nearestdistance);
 
     return result;
 }
 
+/* ******************************************************************** */
+
+/*
+
+Purpose
+=======
+
+The pmlcluster routine performs clustering using pairwise maximum- (complete-)
+linking on the given distance matrix.
+
+Arguments
+=========
+
+nelements     (input) int
+The number of elements to be clustered.
+
+distmatrix (input) DistanceMatrix*
+The distance matrix between the nelements elements. The distance matrix will be
+modified by this routine.
+
+nmerges    (input) int
+The number of merges to return, nelements-1 for the full tree.
+
+nnchain    (input) int
+Whether to use the nearest-neighbor chain algorithm.
+
+Return value
+============
+
+A pointer to a newly allocated array of Node structs, describing the
+hierarchical clustering solution consisting of nelements-1 nodes. Depending on
+whether genes (rows) or microarrays (columns) were clustered, nelements is
+equal to nrows or ncolumns. See src/cluster.h for a description of the Node
+structure.
+If a memory error occurs, pmlcluster returns NULL.
+
+The clusters are found by pairwisecluster, or by the faster nearest-neighbor
+chain algorithm of nnchaincluster if nnchain is nonzero, which may order merges
+at equal distances differently.
+========================================================================
+*/
+static Node* pmlcluster (int nelements, DistanceMatrix *distmatrix, int nmerges, int nnchain) {
+    if (nnchain)
+        return nnchaincluster (nelements, distmatrix, 'm', nmerges, NULL);
+    return pairwisecluster (nelements, distmatrix, 'm', nmerges, NULL);
+}
+
 /* ******************************************************************* */
 
 /*
@@ -3908,10 +5711,15 @@ Arguments
 nelements     (input) int
 The number of elements to be clustered.
 
-distmatrix (input) double**
-The distance matrix, with nelements rows, each row being filled up to the
-diagonal. The elements on the diagonal are not used, as they are assumed to be
-zero. The distance matrix will be modified by this routine.
+distmatrix (input) DistanceMatrix*
+The distance matrix between the nelements elements. The distance matrix will be
+modified by this routine.
+
+nmerges    (input) int
+The number of merges to return, nelements-1 for the full tree.
+
+nnchain    (input) int
+Whether to use the nearest-neighbor chain algorithm.
 
 Return value
 ============
@@ -3922,79 +5730,118 @@ whether genes (rows) or microarrays (columns) were clustered, nelements is
 equal to nrows or ncolumns. See src/cluster.h for a description of the Node
 structure.
 If a memory error occurs, palcluster returns NULL.
+
+The clusters are found by pairwisecluster, or by the faster nearest-neighbor
+chain algorithm of nnchaincluster if nnchain is nonzero, which may order merges
+at equal distances differently.
 ========================================================================
 */
-static Node* palcluster (int nelements, double **distmatrix) {
+static Node* palcluster (int nelements, DistanceMatrix *distmatrix, int nmerges, int nnchain) {
+    if (nnchain)
+        return nnchaincluster (nelements, distmatrix, 'a', nmerges, NULL);
+    return pairwisecluster (nelements, distmatrix, 'a', nmerges, NULL);
+}
 
-    int j;
-    int n;
-    int *clusterid;
-    int *number;
-    Node *result;
+/* ******************************************************************* */
 
-    clusterid = malloc (nelements * sizeof (int));
-    if (!clusterid)
-        return NULL;
-    number = malloc (nelements * sizeof (int));
-    if (!number) {
-        free (clusterid);
-        return NULL;
-    }
-    result = malloc ((nelements - 1) * sizeof (Node));
-    if (!result) {
-        free (clusterid);
-        free (number);
-        return NULL;
-    }
+/*
+Purpose
+=======
 
-    /* Setup a list specifying to which cluster a gene belongs, and keep track
-     * of the number of elements in each cluster (needed to calculate the
-     * average). */
-    for (j = 0; j < nelements; j++) {
-        number[j] = 1;
-        clusterid[j] = j;
-    }
+The pwlcluster routine performs clustering using Ward's minimum variance
+linking on the given distance matrix:
 
-    for (n = nelements; n > 1; n--) {
-        int sum;
-        int is = 1;
-        int js = 0;
-        result[nelements - n].distance = find_closest_pair (n, distmatrix, &is, &js);
+Joe H. Ward, Jr.
+Hierarchical grouping to optimize an objective function
+Journal of the American Statistical Association, 58(301), 1963, pages 236-244.
 
-        /* Save result */
-        result[nelements - n].left = clusterid[is];
-        result[nelements - n].right = clusterid[js];
+Each merge joins the two clusters whose union least increases the sum of
+squared distances of the elements to their cluster centroid. The distances to
+a merged cluster follow from the Lance-Williams formula for Ward's method, which
+assumes squared Euclidean distances. The Euclidean distance (dist=='e') of
+this library is the mean squared difference, so each merge distance is twice
+the increase in the sum of squared distances, divided by the sum of the
+weights. With other distance measures the same formula is applied as is.
 
-        /* Fix the distances */
-        sum = number[is] + number[js];
-        for (j = 0; j < js; j++) {
-            distmatrix[js][j] = distmatrix[is][j] * number[is] + distmatrix[js][j] * number[js];
-            distmatrix[js][j] /= sum;
-        }
-        for (j = js + 1; j < is; j++) {
-            distmatrix[j][js] = distmatrix[is][j] * number[is] + distmatrix[j][js] * number[js];
-            distmatrix[j][js] /= sum;
-        }
-        for (j = is + 1; j < n; j++) {
-            distmatrix[j][js] = distmatrix[j][is] * number[is] + distmatrix[j][js] * number[js];
-            distmatrix[j][js] /= sum;
-        }
+Arguments
+=========
 
-        for (j = 0; j < is; j++)
-            distmatrix[is][j] = distmatrix[n - 1][j];
-        for (j = is + 1; j < n - 1; j++)
-            distmatrix[j][is] = distmatrix[n - 1][j];
+nelements     (input) int
+The number of elements to be clustered.
 
-        /* Update number of elements in the clusters */
-        number[js] = sum;
-        number[is] = number[n - 1];
+distmatrix (input) DistanceMatrix*
+The distance matrix between the nelements elements. The distance matrix will be
+modified by this routine.
 
-        /* Update clusterids */
-        clusterid[js] = n - nelements - 1;
-        clusterid[is] = clusterid[n - 1];
+nmerges    (input) int
+The number of merges to return, nelements-1 for the full tree.
+
+nnchain    (input) int
+Whether to use the nearest-neighbor chain algorithm.
+
+Return value
+============
+
+A pointer to a newly allocated array of Node structs, describing the
+hierarchical clustering solution consisting of nelements-1 nodes. See
+src/cluster.h for a description of the Node structure.
+If a memory error occurs, pwlcluster returns NULL.
+
+The clusters are found by pairwisecluster, or by the faster nearest-neighbor
+chain algorithm of nnchaincluster if nnchain is nonzero, which may order merges
+at equal distances differently.
+========================================================================
+*/
+static Node* pwlcluster (int nelements, DistanceMatrix *distmatrix, int nmerges, int nnchain) {
+    if (nnchain)
+        return nnchaincluster (nelements, distmatrix, 'w', nmerges, NULL);
+    return pairwisecluster (nelements, distmatrix, 'w', nmerges, NULL);
+}
+
+/* ******************************************************************* */
+
+/* Runs the hierarchical clustering of treecluster, returning only the first
+ * nmerges nodes of the tree where the method allows to stop early (see
+ * flatcluster). */
+static Node* hierarchical (int nrows, int ncolumns, double **data, int **mask, double weight[],
+                           int transpose, char dist, char method, DistanceMatrix *distmatrix,
+                           int nnchain, int nmerges) {
+
+    Node *result = NULL;
+    const int nelements = (transpose == 0) ? nrows : ncolumns;
+    const int ldistmatrix = (distmatrix == NULL && method != 's') ? 1 : 0;
+
+    if (nelements < 2)
+        return NULL;
+
+    /* Calculate the distance matrix if the user didn't give it */
+    if (ldistmatrix) {
+        distmatrix = distancematrix (nrows, ncolumns, data, mask, weight, dist, transpose, 'd', NULL);
+        if (!distmatrix)
+            return NULL;        /* Insufficient memory */
     }
-    free (clusterid);
-    free (number);
+
+    switch (method) {
+        case 's':
+            result = pslcluster (nrows, ncolumns, data, mask, weight, distmatrix, dist, transpose);
+            break;
+        case 'm':
+            result = pmlcluster (nelements, distmatrix, nmerges, nnchain);
+            break;
+        case 'a':
+            result = palcluster (nelements, distmatrix, nmerges, nnchain);
+            break;
+        case 'c':
+            result = pclcluster (nrows, ncolumns, data, mask, weight, distmatrix, dist, transpose, nmerges);
+            break;
+        case 'w':
+            result = pwlcluster (nelements, distmatrix, nmerges, nnchain);
+            break;
+    }
+
+    /* Deallocate space for distance matrix, if it was allocated by treecluster */
+    if (ldistmatrix)
+        freedistancematrix (distmatrix);
 
     return result;
 }
@@ -4006,7 +5853,7 @@ Purpose
 =======
 
 The treecluster routine performs hierarchical clustering using pairwise
-single-, maximum-, centroid-, or average-linkage, as defined by method, on a
+single-, maximum-, centroid-, average- or Ward linkage, as defined by method, on a
 given set of gene expression data, using the distance metric given by dist.
 If successful, the function returns a pointer to a newly allocated Tree struct
 containing the hierarchical clustering solution, and NULL if a memory error
@@ -4054,18 +5901,28 @@ method=='s': pairwise single-linkage clustering
 method=='m': pairwise maximum- (or complete-) linkage clustering
 method=='a': pairwise average-linkage clustering
 method=='c': pairwise centroid-linkage clustering
-For the first three, either the distance matrix or the gene expression data is
-sufficient to perform the clustering algorithm. For pairwise centroid-linkage
+method=='w': Ward's minimum variance linkage clustering
+For all but centroid-linkage, either the distance matrix or the gene expression
+data is sufficient to perform the clustering algorithm. For pairwise centroid-linkage
 clustering, however, the gene expression data are always needed, even if the
 distance matrix itself is available.
 
-distmatrix (input) double**
+distmatrix (input) DistanceMatrix*
 The distance matrix. If the distance matrix is zero initially, the distance
 matrix will be allocated and calculated from the data by treecluster, and
 deallocated before treecluster returns. If the distance matrix is passed by the
 calling routine, treecluster will modify the contents of the distance matrix as
 part of the clustering algorithm, but will not deallocate it. The calling
-routine should deallocate the distance matrix after the return from treecluster.
+routine should deallocate the distance matrix with freedistancematrix after the
+return from treecluster. A distance matrix with float precision (see
+distancematrix) halves the memory needed, with merge distances rounded to float.
+
+nnchain    (input) int
+If nonzero, pairwise maximum-, average- and Ward linkage clustering use the
+nearest-neighbor chain algorithm (see nnchaincluster), which takes
+O(nelements^2) time in all cases but may make merges at equal distances in a
+different order, and so cut ties differently. Otherwise the closest pair is
+merged each time, as in the original Cluster 3.0 (see pairwisecluster).
 
 Return value
 ============
@@ -4079,54 +5936,313 @@ If a memory error occurs, treecluster returns NULL.
 
 ========================================================================
 */
-Node* treecluster (int nrows, int ncolumns, double **data, int **mask,
-                   double weight[], int transpose, char dist, char method, double **distmatrix) {
+Node* treecluster (int nrows, int ncolumns, double **data, int **mask, double weight[],
+                   int transpose, char dist, char method, DistanceMatrix *distmatrix, int nnchain) {
+    const int nelements = (transpose == 0) ? nrows : ncolumns;
+    return hierarchical (nrows, ncolumns, data, mask, weight, transpose, dist, method, distmatrix,
+                         nnchain, nelements - 1);
+}
+
+/* ******************************************************************* */
+
+/* Assigns each element to a cluster, given the first nmerges nodes of a tree
+ * (see cuttree): each of the nelements-nmerges subtrees becomes a cluster. */
+static int labelmerges (int nelements, const Node *tree, int nmerges, int clusterid[]) {
+    int i, k;
+    int icluster = 0;
+    int *nodeid = malloc ((nmerges > 0 ? nmerges : 1) * sizeof (int));
+    if (!nodeid)
+        return 0;
+    for (i = 0; i < nelements; i++)
+        clusterid[i] = -1;
+    for (i = 0; i < nmerges; i++)
+        nodeid[i] = -1;
+    for (i = nmerges - 1; i >= 0; i--) {
+        if (nodeid[i] < 0)
+            nodeid[i] = icluster++;
+        k = tree[i].left;
+        if (k < 0)
+            nodeid[-k - 1] = nodeid[i];
+        else
+            clusterid[k] = nodeid[i];
+        k = tree[i].right;
+        if (k < 0)
+            nodeid[-k - 1] = nodeid[i];
+        else
+            clusterid[k] = nodeid[i];
+    }
+    for (i = 0; i < nelements; i++)
+        if (clusterid[i] < 0)
+            clusterid[i] = icluster++;
+    free (nodeid);
+    return 1;
+}
+
+/*
+Purpose
+=======
+
+The flatcluster routine divides the elements into nclusters clusters by
+hierarchical clustering, giving the same clusters as treecluster followed by
+cuttree. The final nclusters-1 merges are not made: pairwise centroid-,
+maximum-, average- and Ward linkage clustering stop after nelements-nclusters
+merges, or, with nnchain, once the nearest-neighbor chain has provably found
+the first nelements-nclusters merges (see nnchaincluster). Pairwise
+single-linkage clustering builds the full tree, at no extra cost.
+
+Arguments
+=========
+
+The arguments nrows to nnchain are the same as for treecluster.
+
+nclusters  (input) int
+The number of clusters to be formed, between 1 and nelements.
+
+clusterid  (output) int[nelements]
+The number of the cluster to which each element was assigned.
+
+Return value
+============
+
+1 on success, 0 if a memory error occurs.
+
+========================================================================
+*/
+int flatcluster (int nrows, int ncolumns, double **data, int **mask, double weight[],
+                 int transpose, char dist, char method, DistanceMatrix *distmatrix, int nnchain,
+                 int nclusters, int clusterid[]) {
+    int ok;
+    Node *tree;
+    const int nelements = (transpose == 0) ? nrows : ncolumns;
+    const int nmerges = nelements - nclusters;
+
+    if (nclusters < 1 || nclusters > nelements)
+        return 0;
+    if (nmerges == 0)
+        return labelmerges (nelements, NULL, 0, clusterid);
+    tree = hierarchical (nrows, ncolumns, data, mask, weight, transpose, dist, method, distmatrix, nnchain,
+                         method == 's' ? nelements - 1 : nmerges);
+    if (!tree)
+        return 0;
+    ok = labelmerges (nelements, tree, nmerges, clusterid);
+    free (tree);
+    return ok;
+}
+
+/* ******************************************************************* */
+
+/*
+Purpose
+=======
+
+The microtreecluster routine performs hierarchical clustering in two stages, for
+data sets too large for the distance matrix of treecluster. The elements are
+first compressed into nmicro micro-clusters by a single k-means pass (see
+kcluster); the micro-clusters, represented by their centroids, are then
+clustered hierarchically as in treecluster. Average and Ward linkage weight each
+micro-cluster by its number of elements, and centroid linkage weights each
+centroid value by the number of elements it was averaged over, so that their
+merges approximate those of the elements themselves. The memory used is of the
+order of nmicro*nmicro instead of nelements*nelements.
+
+Arguments
+=========
+
+The arguments nrows to method are the same as for treecluster.
+
+nnchain    (input) int
+Whether to use the nearest-neighbor chain algorithm, as in treecluster.
+
+nmicro     (input) int
+The number of micro-clusters, at least 2. If nmicro is not less than nelements,
+the elements themselves are clustered.
+
+assign     (input) int
+The initialization of the k-means pass, as in kcluster.
+
+params     (input) KParams*
+Optional convergence control of the k-means pass, as in kcluster.
+
+clusterid  (output) int[nelements]
+The micro-cluster of each element, which is the leaf of the tree it belongs to.
+
+nleaves    (output) int*
+The number of micro-clusters in the tree. This is less than nmicro if some
+micro-clusters were left empty.
+
+Return value
+============
+
+A pointer to a newly allocated array of *nleaves-1 Node structs, describing
+the hierarchical clustering of the micro-clusters.
+If a memory error occurs, microtreecluster returns NULL.
 
+========================================================================
+*/
+Node* microtreecluster (int nrows, int ncolumns, double **data, int **mask, double weight[],
+                        int transpose, char dist, char method, int nnchain, int nmicro, int assign,
+                        const KParams *params, int clusterid[], int *nleaves) {
+    int i, j, k;
+    int ifound;
+    int nclusters = 0;
+    double error;
+    double **cdata;
+    int **cmask;
+    int *sizes;
+    DistanceMatrix *distmatrix;
     Node *result = NULL;
     const int nelements = (transpose == 0) ? nrows : ncolumns;
-    const int ldistmatrix = (distmatrix == NULL && method != 's') ? 1 : 0;
+    const int ndata = (transpose == 0) ? ncolumns : nrows;
 
-    if (nelements < 2)
+    *nleaves = 0;
+    if (nmicro < 2 || nelements < 2)
         return NULL;
+    if (nmicro >= nelements) {
+        for (i = 0; i < nelements; i++)
+            clusterid[i] = i;
+        *nleaves = nelements;
+        return treecluster (nrows, ncolumns, data, mask, weight, transpose, dist, method, NULL, nnchain);
+    }
 
-    /* Calculate the distance matrix if the user didn't give it */
-    if (ldistmatrix) {
-        distmatrix = distancematrix (nrows, ncolumns, data, mask, weight, dist, transpose);
-        if (!distmatrix)
-            return NULL;        /* Insufficient memory */
+    kcluster (nmicro, nrows, ncolumns, data, mask, weight, transpose, 1, 'a', dist, clusterid, &error,
+              &ifound, assign, params);
+    if (ifound < 1)
+        return NULL;
+
+    /* Number the micro-clusters that have elements consecutively */
+    sizes = calloc (nmicro, sizeof (int));
+    if (!sizes)
+        return NULL;
+    for (i = 0; i < nelements; i++)
+        sizes[clusterid[i]]++;
+    for (k = 0; k < nmicro; k++)
+        sizes[k] = sizes[k] ? nclusters++ : -1;
+    for (i = 0; i < nelements; i++)
+        clusterid[i] = sizes[clusterid[i]];
+    if (nclusters < 2 || !makedatamask (nclusters, ndata, &cdata, &cmask)) {
+        free (sizes);
+        return NULL;
     }
 
-    switch (method) {
-        case 's':
-            result = pslcluster (nrows, ncolumns, data, mask, weight, distmatrix, dist, transpose);
-            break;
-        case 'm':
-            result = pmlcluster (nelements, distmatrix);
-            break;
-        case 'a':
-            result = palcluster (nelements, distmatrix);
-            break;
-        case 'c':
-            result = pclcluster (nrows, ncolumns, data, mask, weight, distmatrix, dist, transpose);
-            break;
+    /* The centroids, with the number of elements behind each value as its mask */
+    for (k = 0; k < nclusters; k++) {
+        sizes[k] = 0;
+        for (j = 0; j < ndata; j++) {
+            cdata[k][j] = 0.;
+            cmask[k][j] = 0;
+        }
+    }
+    for (i = 0; i < nelements; i++) {
+        k = clusterid[i];
+        sizes[k]++;
+        for (j = 0; j < ndata; j++) {
+            const int present = transpose ? mask[j][i] : mask[i][j];
+            if (present) {
+                cdata[k][j] += transpose ? data[j][i] : data[i][j];
+                cmask[k][j]++;
+            }
+        }
     }
+    for (k = 0; k < nclusters; k++)
+        for (j = 0; j < ndata; j++)
+            if (cmask[k][j])
+                cdata[k][j] /= cmask[k][j];
 
-    /* Deallocate space for distance matrix, if it was allocated by treecluster */
-    if (ldistmatrix) {
-        int i;
-        for (i = 1; i < nelements; i++)
-            free (distmatrix[i]);
-        free (distmatrix);
+    distmatrix = distancematrix (nclusters, ndata, cdata, cmask, weight, dist, 0, 'd', NULL);
+    if (distmatrix) {
+        if (method == 'w') {
+            /* Ward's distance between clusters of sizes a and b is 2ab/(a+b)
+             * times the distance between their centroids */
+            for (i = 1; i < nclusters; i++)
+                for (j = 0; j < i; j++)
+                    setdistance (distmatrix, i, j, getdistance (distmatrix, i, j) * 2. * sizes[i] * sizes[j]
+                                                   / (sizes[i] + sizes[j]));
+        }
+        switch (method) {
+            case 's':
+                result = pslcluster (nclusters, ndata, cdata, cmask, weight, distmatrix, dist, 0);
+                break;
+            case 'm':
+            case 'a':
+            case 'w':
+                if (nnchain)
+                    result = nnchaincluster (nclusters, distmatrix, method, nclusters - 1, sizes);
+                else
+                    result = pairwisecluster (nclusters, distmatrix, method, nclusters - 1, sizes);
+                break;
+            case 'c':
+                result = pclcluster (nclusters, ndata, cdata, cmask, weight, distmatrix, dist, 0,
+                                     nclusters - 1);
+                break;
+        }
+        freedistancematrix (distmatrix);
     }
+    if (result)
+        *nleaves = nclusters;
 
+    freedatamask (nclusters, cdata, cmask);
+    free (sizes);
     return result;
 }
 
 /* ******************************************************************* */
 
+/* Initializes the nodes on the plane spanned by the first two principal axes of
+ * the elements, each scaled by stddata as in somworker: node (ix, iy) is placed
+ * at the mean plus up to one standard deviation along the first axis for ix and
+ * along the second for iy, then normalized like the nodes in somworker.
+ * Returns 0 if out of memory.
+ */
+static int somlinearinit (int nrows, int ncolumns, double **data, int **mask, int transpose,
+                          int nxgrid, int nygrid, const double stddata[], double ***celldata) {
+
+    const int nelements = (transpose == 0) ? nrows : ncolumns;
+    const int ndata = (transpose == 0) ? ncolumns : nrows;
+    int i, ix, iy;
+    double variance[2];
+    double *mean = malloc (ndata * sizeof (double));
+    double **axes;
+    int **amask;
+
+    if (!mean || !makedatamask (2, ndata, &axes, &amask)) {
+        free (mean);
+        return 0;
+    }
+    if (!principal_axes (ndata, nelements, NULL, data, mask, NULL, transpose, NULL, stddata, 2, mean, axes,
+                         variance)) {
+        free (mean);
+        freedatamask (2, axes, amask);
+        return 0;
+    }
+
+    for (ix = 0; ix < nxgrid; ix++) {
+        for (iy = 0; iy < nygrid; iy++) {
+            const double x = nxgrid > 1 ? 2.0 * ix / (nxgrid - 1) - 1.0 : 0.;
+            const double y = nygrid > 1 ? 2.0 * iy / (nygrid - 1) - 1.0 : 0.;
+            double sum = 0.;
+            for (i = 0; i < ndata; i++) {
+                double term = mean[i] + x * sqrt (variance[0]) * axes[0][i] + y * sqrt (variance[1]) * axes[1][i];
+                celldata[ix][iy][i] = term;
+                sum += term * term;
+            }
+            if (sum > 0) {
+                sum = sqrt (sum / ndata);
+                for (i = 0; i < ndata; i++)
+                    celldata[ix][iy][i] /= sum;
+            }
+        }
+    }
+
+    free (mean);
+    freedatamask (2, axes, amask);
+    return 1;
+}
+
+/* ******************************************************************* */
+
 static void somworker (int nrows, int ncolumns, double **data, int **mask,
                        const double weights[], int transpose, int nxgrid, int nygrid,
-                       double inittau, double ***celldata, int niter, char dist) {
+                       double inittau, double ***celldata, int niter, char dist, uint64_t seed, int assign) {
 
     const int nelements = (transpose == 0) ? nrows : ncolumns;
     const int ndata = (transpose == 0) ? ncolumns : nrows;
@@ -4136,6 +6252,7 @@ static void somworker (int nrows, int ncolumns, double **data, int **mask,
     int ix, iy;
     int *index;
     int iter;
+    RandomState random;
     /* Maximum radius in which nodes are adjusted */
     double maxradius = sqrt (nxgrid * nxgrid + nygrid * nygrid);
 
@@ -4197,18 +6314,21 @@ static void somworker (int nrows, int ncolumns, double **data, int **mask,
         }
     }
 
-    /* Randomly initialize the nodes */
-    for (ix = 0; ix < nxgrid; ix++) {
-        for (iy = 0; iy < nygrid; iy++) {
-            double sum = 0.;
-            for (i = 0; i < ndata; i++) {
-                double term = -1.0 + 2.0 * uniform ();
-                celldata[ix][iy][i] = term;
-                sum += term * term;
+    /* Initialize the nodes linearly along the principal axes, or randomly */
+    randomseed (&random, seed);
+    if (assign != 5 || !somlinearinit (nrows, ncolumns, data, mask, transpose, nxgrid, nygrid, stddata, celldata)) {
+        for (ix = 0; ix < nxgrid; ix++) {
+            for (iy = 0; iy < nygrid; iy++) {
+                double sum = 0.;
+                for (i = 0; i < ndata; i++) {
+                    double term = -1.0 + 2.0 * uniform (&random);
+                    celldata[ix][iy][i] = term;
+                    sum += term * term;
+                }
+                sum = sqrt (sum / ndata);
+                for (i = 0; i < ndata; i++)
+                    celldata[ix][iy][i] /= sum;
             }
-            sum = sqrt (sum / ndata);
-            for (i = 0; i < ndata; i++)
-                celldata[ix][iy][i] /= sum;
         }
     }
 
@@ -4217,7 +6337,7 @@ static void somworker (int nrows, int ncolumns, double **data, int **mask,
     for (i = 0; i < nelements; i++)
         index[i] = i;
     for (i = 0; i < nelements; i++) {
-        j = (int) (i + (nelements - i) * uniform ());
+        j = (int) (i + (nelements - i) * uniform (&random));
         ix = index[j];
         index[j] = index[i];
         index[i] = ix;
@@ -4489,11 +6609,22 @@ cluster assignments are not returned. If clusterid is not NULL, enough memory
 should be allocated to store the clustering information before calling
 somcluster.
 
+seed       (input) uint64_t
+The seed of the random number generator used to initialize the nodes and the
+order in which items are presented, see randomseed.
+
+assign     (input) int
+The initialization of the nodes. If assign == 5 (PCA, as in kcluster), the nodes
+are spread linearly over the plane of the first two principal axes of the
+items, which is deterministic and needs fewer iterations to unfold; otherwise
+they are initialized randomly.
+
 ========================================================================
 */
 void somcluster (int nrows, int ncolumns, double **data, int **mask,
                  const double weight[], int transpose, int nxgrid, int nygrid,
-                 double inittau, int niter, char dist, double ***celldata, int **clusterid) {
+                 double inittau, int niter, char dist, double ***celldata, int **clusterid, uint64_t seed,
+                 int assign) {
 
     const int nobjects = (transpose == 0) ? nrows : ncolumns;
     const int ndata = (transpose == 0) ? ncolumns : nrows;
@@ -4512,7 +6643,8 @@ void somcluster (int nrows, int ncolumns, double **data, int **mask,
         }
     }
 
-    somworker (nrows, ncolumns, data, mask, weight, transpose, nxgrid, nygrid, inittau, celldata, niter, dist);
+    somworker (nrows, ncolumns, data, mask, weight, transpose, nxgrid, nygrid, inittau, celldata, niter, dist, seed,
+               assign);
     if (clusterid)
         somassign(nrows, ncolumns, data, mask, weight, transpose, nxgrid, nygrid, celldata, dist, clusterid);
     if (lcelldata == 0) {
@@ -38,26 +38,134 @@
 #  include <windows.h>
 #endif
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define CLUSTERVERSION "1.50"
 
+/* Random numbers */
+typedef struct {uint64_t s[4];} RandomState;
+/*
+ * A RandomState struct holds the state of a xoshiro256** generator. Each run
+ * seeds its own state with randomseed, so runs can be reproduced and
+ * concurrent runs never share state. randomjump advances a state by 2^128
+ * draws, giving independent streams for passes or threads.
+ */
+void randomseed (RandomState* state, uint64_t seed);
+uint64_t randomentropy (void);
+void randomjump (RandomState* state);
+double uniform (RandomState* state);
+
 /* Chapter 2 */
 double clusterdistance (int nrows, int ncolumns, double** data, int** mask,
   double weight[], int n1, int n2, int index1[], int index2[], char dist,
   char method, int transpose);
-double** distancematrix (int ngenes, int ndata, double** data,
-  int** mask, double* weight, char dist, int transpose);
+
+typedef struct {
+  int n;              /* number of elements */
+  char precision;     /* 'd' for double, 'f' for float distances */
+  int blocked;        /* whether the distances are stored in DISTANCEBLOCK tiles */
+  void *values;       /* the distances below the diagonal, see getdistance */
+  size_t mapped;      /* bytes mapped from a temporary file, 0 if held in memory */
+} DistanceMatrix;
+/*
+ * A DistanceMatrix struct holds the distances between n elements in a single
+ * condensed buffer. As the matrix is symmetric with zeros on the diagonal,
+ * only the lower triangle is stored: d(1,0), d(2,0), d(2,1), d(3,0), ... The
+ * distance between elements i > j is at offset i*(i-1)/2+j, see
+ * distanceoffset. Float distances halve the memory at the cost of precision.
+ * If a directory is given, the buffer is a memory-mapped temporary file in it
+ * ("" for the system default), so that the matrix may exceed the RAM. Such a
+ * matrix is blocked: the lower triangle is cut into square tiles of
+ * DISTANCEBLOCK elements a side, stored one after the other row after row of
+ * tiles, each tile row after row (see getblockdistance). The linkage routines read
+ * rows as well as columns of the matrix; in a row-major triangle a column takes
+ * one page from every later row, while in tiles a row or a column of n distances
+ * takes a page (two for double) from each of only n/DISTANCEBLOCK tiles.
+ */
+#define DISTANCEBLOCK 32
+
+DistanceMatrix* newdistancematrix (int n, char precision, const char* directory);
+void freedistancematrix (DistanceMatrix* matrix);
+DistanceMatrix* distancematrix (int ngenes, int ndata, double** data,
+  int** mask, double* weight, char dist, int transpose, char precision,
+  const char* directory);
+
+/* Offset of the distance between elements i and j, i != j, in the condensed lower triangle */
+static inline size_t distanceoffset (int i, int j) {
+  return (i > j) ? (size_t) i * (i - 1) / 2 + j : (size_t) j * (j - 1) / 2 + i;
+}
+/* Number of values in the buffer of a DistanceMatrix between n elements */
+static inline size_t distancecount (int n, int blocked) {
+  const size_t nb = ((size_t) n + DISTANCEBLOCK - 1) / DISTANCEBLOCK;
+  if (blocked) return nb * (nb + 1) / 2 * DISTANCEBLOCK * DISTANCEBLOCK;
+  return (n > 1) ? (size_t) n * (n - 1) / 2 : 1;
+}
+static inline double distancevalue (const DistanceMatrix* matrix, size_t k) {
+  if (matrix->precision == 'f') return ((const float*) matrix->values)[k];
+  return ((const double*) matrix->values)[k];
+}
+/* Blocked matrices, kept out of line so that the others stay inlined */
+double getblockdistance (const DistanceMatrix* matrix, int i, int j);
+void setblockdistance (DistanceMatrix* matrix, int i, int j, double value);
+static inline double getdistance (const DistanceMatrix* matrix, int i, int j) {
+  if (matrix->blocked) return getblockdistance (matrix, i, j);
+  return distancevalue (matrix, distanceoffset (i, j));
+}
+static inline void setdistance (DistanceMatrix* matrix, int i, int j, double value) {
+  if (matrix->blocked) setblockdistance (matrix, i, j, value);
+  else if (matrix->precision == 'f') ((float*) matrix->values)[distanceoffset (i, j)] = (float) value;
+  else ((double*) matrix->values)[distanceoffset (i, j)] = value;
+}
 
 /* Chapter 3 */
+typedef struct {
+  int npass;          /* number of passes recorded */
+  int *iterations;    /* int[npass], iterations used by each pass */
+  double *errors;     /* error after every iteration, pass after pass */
+  int nerrors;        /* number of errors recorded */
+  int size;           /* allocated length of errors */
+  long skipped;       /* dimension terms skipped by early abandoned distances */
+} KTrace;
+/*
+ * A KTrace struct records how a kcluster run converged. The errors of pass p
+ * start after the sum of iterations[0..p-1]. The arrays are allocated by
+ * kcluster and should be freed by the caller.
+ */
+
+typedef struct {
+  double tolerance;   /* stop a pass when the relative error improvement is below this */
+  double moved;       /* stop a pass when fewer than this fraction of elements moved */
+  int maxiter;        /* maximum number of iterations per pass, 0 for no limit */
+  int nsample;        /* k-medians: members drawn at random per cluster median, 0 for exact */
+  int prune;          /* early abandoned distances: 0 auto (d >= 512), > 0 always, < 0 never */
+  int chain;          /* AFK-MC2 seeding: Markov chain length, 0 for 200 */
+  int candidates;     /* kmeans++ seeding: greedy candidates per center, 0 or 1 for one */
+  int coreset;        /* k-means: cluster a weighted sample of this many draws, 0 for all elements */
+  const double *eweight; /* weight of each element, as that many copies of it, NULL if all are 1 */
+  int repeats;        /* stop starting passes once the optimum was found this often, 0 for npass */
+  double budget;      /* stop passes after this many seconds, 0 for no limit */
+  int abort;          /* abandon passes that look unlikely to beat the best error */
+  uint64_t seed;      /* random seed, see randomentropy for one that is not reproduced */
+  KTrace *trace;      /* convergence record, NULL if not needed */
+} KParams;
+/*
+ * A KParams struct controls the iterations of kcluster. A zero filled struct
+ * (or a NULL pointer) runs every pass until the solution stops improving.
+ */
+
 int getclustercentroids(int nclusters, int nrows, int ncolumns,
   double** data, int** mask, int clusterid[], double** cdata, int** cmask,
-  int transpose, char method);
-void getclustermedoids(int nclusters, int nelements, double** distance,
+  int transpose, char method, const double eweight[]);
+void getclustermedoids(int nclusters, int nelements, const DistanceMatrix* distance,
   int clusterid[], int centroids[], double errors[]);
 void kcluster (int nclusters, int ngenes, int ndata, double** data,
   int** mask, double weight[], int transpose, int npass, char method, char dist,
-  int clusterid[], double* error, int* ifound, int assign);
-void kmedoids (int nclusters, int nelements, double** distance,
-  int npass, int clusterid[], double* error, int* ifound);
+  int clusterid[], double* error, int* ifound, int assign, const KParams* params);
+void kmedoids (int nclusters, int nelements, const DistanceMatrix* distance,
+  int npass, int clusterid[], double* error, int* ifound, uint64_t seed);
+int silhouette (int nclusters, const DistanceMatrix* distmatrix,
+  const int clusterid[], double values[], double* score);
 
 /* Chapter 4 */
 typedef struct {int left; int right; double distance;} Node;
@@ -72,14 +180,22 @@ typedef struct {int left; int right; double distance;} Node;
  */
 
 Node* treecluster (int nrows, int ncolumns, double** data, int** mask,
-  double weight[], int transpose, char dist, char method, double** distmatrix);
+  double weight[], int transpose, char dist, char method, DistanceMatrix* distmatrix,
+  int nnchain);
 void cuttree (int nelements, Node* tree, int nclusters, int clusterid[]);
+int cutdistance (int nelements, const Node* tree, double threshold, int clusterid[]);
+int flatcluster (int nrows, int ncolumns, double** data, int** mask,
+  double weight[], int transpose, char dist, char method, DistanceMatrix* distmatrix,
+  int nnchain, int nclusters, int clusterid[]);
+Node* microtreecluster (int nrows, int ncolumns, double** data, int** mask,
+  double weight[], int transpose, char dist, char method, int nnchain, int nmicro, int assign,
+  const KParams* params, int clusterid[], int* nleaves);
 
 /* Chapter 5 */
 void somcluster (int nrows, int ncolumns, double** data, int** mask,
   const double weight[], int transpose, int nxnodes, int nynodes,
   double inittau, int niter, char dist, double*** celldata,
-  int **clusterid);
+  int **clusterid, uint64_t seed, int assign);
 
 /* Chapter 6 */
 int pca(int m, int n, double** u, double** v, double* w);
@@ -2,4 +2,14 @@
 
 require 'mkmf'
 $CFLAGS  = '-fPIC -Os -Wall'
+
+# parallel loops are run with OpenMP when the compiler supports it.
+if try_compile('int main() { return 0; }', '-fopenmp')
+  $CFLAGS  << ' -fopenmp'
+  $LDFLAGS << ' -fopenmp'
+end
+
+# distance matrices on disk reserve their blocks up front where posix_fallocate exists (not on macOS).
+have_func('posix_fallocate', 'fcntl.h')
+
 create_makefile('flock')
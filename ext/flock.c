@@ -1,11 +1,13 @@
+#include <math.h>
 #include <ruby/ruby.h>
+#include <ruby/thread.h>
 #include "cluster.h"
 
 #define ID_CONST_GET rb_intern("const_get")
 #define CONST_GET(scope, constant) (rb_funcall(scope, ID_CONST_GET, 1, rb_str_new2(constant)))
 #define DEFAULT_ITERATIONS 100
 
-static VALUE mFlock, scFlock;
+static VALUE mFlock, scFlock, cKMeansModel, cDistanceMatrix, cTree;
 typedef double (*distance_fn)(int, double**, double**, int**, int**, const double [], int, int, int);
 
 int get_int_option(VALUE option, char *key, int default_value) {
@@ -35,6 +37,64 @@ VALUE get_value_option(VALUE option, char *key, VALUE default_value) {
     return NIL_P(value) ? default_value : value;
 }
 
+/* Returns 0 if the option is missing or nil, 1 if it is truthy and -1 if false. */
+int get_tristate_option(VALUE option, char *key) {
+    if (NIL_P(option)) return 0;
+
+    VALUE value = rb_hash_aref(option, ID2SYM(rb_intern(key)));
+    return NIL_P(value) ? 0 : (TYPE(value) == T_FALSE ? -1 : 1);
+}
+
+/* Returns the random_seed option (any Integer, 0 included), or a seed from the clock if it is missing. */
+uint64_t get_seed_option(VALUE option) {
+    VALUE value = get_value_option(option, "random_seed", Qnil);
+    return NIL_P(value) ? randomentropy() : (uint64_t)NUM2ULL(rb_Integer(value));
+}
+
+/*
+  Returns the sample_weights option as a newly allocated array of n weights, or NULL if it is missing. The
+  weights are checked before anything is allocated.
+*/
+double* get_sample_weights_option(VALUE option, int n) {
+    int i;
+    double *eweight;
+    VALUE value = get_value_option(option, "sample_weights", Qnil);
+
+    if (NIL_P(value)) return NULL;
+
+    if (TYPE(value) != T_ARRAY || RARRAY_LEN(value) != n)
+        rb_raise(rb_eArgError, "sample_weights should be an array of %d numbers", n);
+
+    for (i = 0; i < n; i++) {
+        if (NUM2DBL(rb_Float(rb_ary_entry(value, i))) < 0)
+            rb_raise(rb_eArgError, "sample_weights should be >= 0");
+    }
+
+    eweight = (double*)malloc(sizeof(double)*n);
+    for (i = 0; i < n; i++)
+        eweight[i] = NUM2DBL(rb_Float(rb_ary_entry(value, i)));
+    return eweight;
+}
+
+/*
+  Reads the k-means options shared by Flock.kcluster, Flock::KMeansModel and the micro-clusters of
+  Flock.treecluster into params. The trace and sample weights are left to the caller.
+*/
+void read_kparams(VALUE options, KParams *params) {
+    params->tolerance  = get_dbl_option(options, "tolerance",      0);
+    params->moved      = get_dbl_option(options, "moved_fraction", 0);
+    params->maxiter    = get_int_option(options, "max_iterations", 0);
+    params->nsample    = get_int_option(options, "median_sample",  0);
+    params->prune      = get_tristate_option(options, "early_abandon");
+    params->chain      = get_int_option(options, "chain_length",   0);
+    params->candidates = get_int_option(options, "candidates",     0);
+    params->coreset    = get_int_option(options, "coreset",        0);
+    params->repeats    = get_int_option(options, "stop_after_repeats", 0);
+    params->budget     = get_dbl_option(options, "time_budget",    0);
+    params->abort      = get_bool_option(options, "abort_passes",  0);
+    params->seed       = get_seed_option(options);
+}
+
 /* @api private */
 VALUE rb_do_kcluster(int argc, VALUE *argv, VALUE self) {
     VALUE size, data, mask, weights, options;
@@ -70,11 +130,18 @@ VALUE rb_do_kcluster(int argc, VALUE *argv, VALUE self) {
     // initial assignment
     int assign    = get_int_option(options, "seed",    0);
 
-    int i,j;
+    // convergence control for each pass
+    KTrace  trace  = {0};
+    KParams params = {0};
+    read_kparams(options, &params);
+    params.trace = &trace;
+
+    int i,j,k;
     int nrows = RARRAY_LEN(data);
     int ncols = RARRAY_LEN(rb_ary_entry(data, 0));
     int nsets = NUM2INT(rb_Integer(size));
 
+    double *eweight         = get_sample_weights_option(options, transpose ? ncols : nrows);
     double **cdata          = (double**)malloc(sizeof(double*)*nrows);
     int    **cmask          = (int   **)malloc(sizeof(int   *)*nrows);
     double *cweights        = (double *)malloc(sizeof(double )*ncols);
@@ -115,18 +182,29 @@ VALUE rb_do_kcluster(int argc, VALUE *argv, VALUE self) {
     int    ifound;
     double error;
 
+    params.eweight = eweight;
     kcluster(nsets,
-        nrows, ncols, cdata, cmask, cweights, transpose, npass, method, dist, ccluster, &error, &ifound, assign);
+        nrows, ncols, cdata, cmask, cweights, transpose, npass, method, dist, ccluster, &error, &ifound, assign, &params);
     getclustercentroids(nsets,
-        nrows, ncols, cdata, cmask, ccluster, ccentroid, ccentroid_mask, transpose, method);
+        nrows, ncols, cdata, cmask, ccluster, ccentroid, ccentroid_mask, transpose, method, eweight);
 
-    VALUE result   = rb_hash_new();
-    VALUE cluster  = rb_ary_new();
-    VALUE centroid = rb_ary_new();
+    VALUE result     = rb_hash_new();
+    VALUE cluster    = rb_ary_new();
+    VALUE centroid   = rb_ary_new();
+    VALUE iterations = rb_ary_new();
+    VALUE errors     = rb_ary_new();
 
     for (i = 0; i < dimx; i++)
         rb_ary_push(cluster, INT2NUM(ccluster[i]));
 
+    for (i = 0, k = 0; i < trace.npass; i++) {
+        VALUE pass = rb_ary_new();
+        for (j = 0; j < trace.iterations[i] && k < trace.nerrors; j++, k++)
+            rb_ary_push(pass, DBL2NUM(trace.errors[k]));
+        rb_ary_push(iterations, INT2NUM(trace.iterations[i]));
+        rb_ary_push(errors, pass);
+    }
+
     for (i = 0; i < cdimx; i++) {
         VALUE point = rb_ary_new();
         for (j = 0; j < cdimy; j++)
@@ -138,6 +216,9 @@ VALUE rb_do_kcluster(int argc, VALUE *argv, VALUE self) {
     rb_hash_aset(result, ID2SYM(rb_intern("centroid")),  centroid);
     rb_hash_aset(result, ID2SYM(rb_intern("error")),     DBL2NUM(error));
     rb_hash_aset(result, ID2SYM(rb_intern("repeated")),  INT2NUM(ifound));
+    rb_hash_aset(result, ID2SYM(rb_intern("pass_iterations")), iterations);
+    rb_hash_aset(result, ID2SYM(rb_intern("error_trace")),     errors);
+    rb_hash_aset(result, ID2SYM(rb_intern("skipped_terms")),   LONG2NUM(trace.skipped));
 
     for (i = 0; i < nrows; i++) {
         free(cdata[i]);
@@ -154,7 +235,10 @@ VALUE rb_do_kcluster(int argc, VALUE *argv, VALUE self) {
     free(ccentroid);
     free(ccentroid_mask);
     free(cweights);
+    free(eweight);
     free(ccluster);
+    free(trace.iterations);
+    free(trace.errors);
 
     return result;
 }
@@ -236,7 +320,8 @@ VALUE rb_do_self_organizing_map(int argc, VALUE *argv, VALUE self) {
             ccelldata[i][j] = (double *)malloc(sizeof(double)*dimy);
     }
 
-    somcluster(nrows, ncols, cdata, cmask, cweights, transpose, nxgrid, nygrid, tau, npass, dist, ccelldata, ccluster);
+    somcluster(nrows, ncols, cdata, cmask, cweights, transpose, nxgrid, nygrid, tau, npass, dist, ccelldata, ccluster,
+               get_seed_option(options), get_int_option(options, "seed", 0));
 
     VALUE result   = rb_hash_new();
     VALUE cluster  = rb_ary_new();
@@ -284,6 +369,293 @@ VALUE rb_do_self_organizing_map(int argc, VALUE *argv, VALUE self) {
     return result;
 }
 
+/*
+  Document-class: Flock::Tree
+
+  The full merge tree of a hierarchical clustering, as returned in the :tree entry of Flock.treecluster. It can be cut
+  into any number of clusters, or at any distance, in O(n) without clustering again.
+
+  @example
+    tree = Flock.treecluster(2, data)[:tree]
+    tree.cut(5)                     #=> [0, 3, 1, ...]
+    tree.cut_distance(0.5)          #=> [0, 1, 1, ...]
+    tree.cut_levels(2..100)         #=> one cut for every size
+*/
+typedef struct {
+    int  n;             /* number of data points */
+    Node *nodes;        /* n-1 merges, see cluster.h */
+} TreeData;
+
+static void tree_free(void *ptr) {
+    TreeData *tree = (TreeData *)ptr;
+    free(tree->nodes);
+    free(tree);
+}
+
+static size_t tree_memsize(const void *ptr) {
+    const TreeData *tree = (const TreeData *)ptr;
+    return sizeof(TreeData) + (tree->nodes ? (tree->n - 1) * sizeof(Node) : 0);
+}
+
+static const rb_data_type_t tree_type = {
+    "Flock::Tree",
+    {0, tree_free, tree_memsize,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE tree_allocate(VALUE klass) {
+    TreeData *tree;
+    return TypedData_Make_Struct(klass, TreeData, &tree_type, tree);
+}
+
+static TreeData* tree_get(VALUE self) {
+    TreeData *tree;
+    TypedData_Get_Struct(self, TreeData, &tree_type, tree);
+    if (!tree->nodes)
+        rb_raise(rb_eRuntimeError, "uninitialized Flock::Tree");
+    return tree;
+}
+
+/* Wraps the merges of a treecluster solution between n data points, taking ownership of nodes. */
+static VALUE tree_wrap(Node *nodes, int n) {
+    TreeData *tree;
+    VALUE self = TypedData_Make_Struct(cTree, TreeData, &tree_type, tree);
+    tree->n     = n;
+    tree->nodes = nodes;
+    return self;
+}
+
+/*
+  Rebuilds a tree from its merges.
+
+  @overload initialize(merges)
+    @param [Array] merges  n-1 merges [left, right, distance] as returned by #to_a, data points numbered 0..n-1 and
+                           the merges themselves -1..-(n-1). Each data point and each merge but the last is joined
+                           exactly once; raises ArgumentError otherwise.
+*/
+static VALUE tree_initialize(VALUE self, VALUE merges) {
+    TreeData *tree;
+    int i, j, n;
+    TypedData_Get_Struct(self, TreeData, &tree_type, tree);
+
+    if (tree->nodes)
+        rb_raise(rb_eRuntimeError, "Flock::Tree already initialized");
+    if (TYPE(merges) != T_ARRAY || RARRAY_LEN(merges) < 1)
+        rb_raise(rb_eArgError, "merges should be a non-empty array of [left, right, distance]");
+
+    n = RARRAY_LEN(merges) + 1;
+    for (i = 0; i < n - 1; i++) {
+        VALUE merge = rb_ary_entry(merges, i);
+        if (TYPE(merge) != T_ARRAY || RARRAY_LEN(merge) != 3)
+            rb_raise(rb_eArgError, "merges should be a non-empty array of [left, right, distance]");
+        for (j = 0; j < 2; j++) {
+            int k = NUM2INT(rb_ary_entry(merge, j));
+            if (k >= n || k < -i)
+                rb_raise(rb_eArgError, "merge %d joins %d, which is not a data point or an earlier merge", i, k);
+        }
+        rb_Float(rb_ary_entry(merge, 2));
+    }
+
+    // every data point and every merge but the last is joined exactly once, so all are used once at most
+    char *seen = (char *)calloc(2*n - 1, 1);
+    for (i = 0; i < n - 1; i++) {
+        VALUE merge = rb_ary_entry(merges, i);
+        for (j = 0; j < 2; j++) {
+            int k = NUM2INT(rb_ary_entry(merge, j));
+            if (seen[k + n - 1]++) {
+                free(seen);
+                rb_raise(rb_eArgError, "merge %d joins %d, which was already joined", i, k);
+            }
+        }
+    }
+    free(seen);
+
+    tree->nodes = (Node *)malloc(sizeof(Node)*(n - 1));
+    tree->n     = n;
+    for (i = 0; i < n - 1; i++) {
+        VALUE merge = rb_ary_entry(merges, i);
+        tree->nodes[i].left     = NUM2INT(rb_ary_entry(merge, 0));
+        tree->nodes[i].right    = NUM2INT(rb_ary_entry(merge, 1));
+        tree->nodes[i].distance = NUM2DBL(rb_Float(rb_ary_entry(merge, 2)));
+    }
+
+    return self;
+}
+
+/* @api private */
+static VALUE tree_initialize_copy(VALUE self, VALUE other) {
+    TreeData *tree, *source = tree_get(other);
+    TypedData_Get_Struct(self, TreeData, &tree_type, tree);
+
+    if (tree->nodes)
+        rb_raise(rb_eRuntimeError, "Flock::Tree already initialized");
+
+    tree->nodes = (Node *)malloc(sizeof(Node)*(source->n - 1));
+    tree->n     = source->n;
+    memcpy(tree->nodes, source->nodes, sizeof(Node)*(source->n - 1));
+    return self;
+}
+
+/*
+  @return [Fixnum] number of data points.
+*/
+static VALUE tree_size(VALUE self) {
+    return INT2NUM(tree_get(self)->n);
+}
+
+/*
+  @return [Array<Array>] the merges [left, right, distance] in the order they were made.
+*/
+static VALUE tree_to_a(VALUE self) {
+    int i;
+    TreeData *tree = tree_get(self);
+    VALUE merges   = rb_ary_new2(tree->n - 1);
+
+    for (i = 0; i < tree->n - 1; i++)
+        rb_ary_push(merges, rb_ary_new3(3, INT2NUM(tree->nodes[i].left), INT2NUM(tree->nodes[i].right),
+                                        DBL2NUM(tree->nodes[i].distance)));
+    return merges;
+}
+
+/*
+  Cuts the tree into clusters at several levels, in O(n) per level.
+
+  @overload cut_levels(levels, options = {})
+    @param [Enumerable] levels   cluster counts, or distances with by: :distance.
+    @param [Hash]       options  :by, :size (default) or :distance.
+    @return [Array<Array>] the cluster of each data point, for every level.
+*/
+static VALUE tree_cut_levels(int argc, VALUE *argv, VALUE self) {
+    VALUE levels, options, by, result;
+    rb_scan_args(argc, argv, "11", &levels, &options);
+
+    int i, j, distance, nlevels;
+    TreeData *tree = tree_get(self);
+
+    by       = get_value_option(options, "by", ID2SYM(rb_intern("size")));
+    distance = by == ID2SYM(rb_intern("distance"));
+    if (!distance && by != ID2SYM(rb_intern("size")))
+        rb_raise(rb_eArgError, "by should be :size or :distance");
+
+    levels  = rb_Array(levels);
+    nlevels = RARRAY_LEN(levels);
+    for (i = 0; i < nlevels; i++) {
+        VALUE level = rb_ary_entry(levels, i);
+        if (distance)
+            rb_Float(level);
+        else if (NUM2INT(rb_Integer(level)) < 1 || NUM2INT(rb_Integer(level)) > tree->n)
+            rb_raise(rb_eArgError, "size should be > 0 and <= data size");
+    }
+
+    result = rb_ary_new2(nlevels);
+    int *ccluster = (int *)malloc(sizeof(int)*tree->n);
+    for (i = 0; i < nlevels; i++) {
+        VALUE level = rb_ary_entry(levels, i);
+        if (distance)
+            cutdistance(tree->n, tree->nodes, NUM2DBL(rb_Float(level)), ccluster);
+        else
+            cuttree(tree->n, tree->nodes, NUM2INT(rb_Integer(level)), ccluster);
+
+        VALUE cluster = rb_ary_new2(tree->n);
+        for (j = 0; j < tree->n; j++)
+            rb_ary_push(cluster, INT2NUM(ccluster[j]));
+        rb_ary_push(result, cluster);
+    }
+    free(ccluster);
+
+    return result;
+}
+
+/*
+  @overload cut(size)
+    @param [Fixnum] size  number of clusters.
+    @return [Array] the cluster of each data point.
+*/
+static VALUE tree_cut(VALUE self, VALUE size) {
+    return rb_ary_entry(tree_cut_levels(1, &size, self), 0);
+}
+
+/*
+  Undoes every merge at a distance above threshold (or with a merge above threshold below it, for centroid linkage).
+
+  @overload cut_distance(threshold)
+    @param [Numeric] threshold  largest distance of the merges kept.
+    @return [Array] the cluster of each data point.
+*/
+static VALUE tree_cut_distance(VALUE self, VALUE threshold) {
+    VALUE args[2] = {rb_ary_new3(1, threshold), rb_hash_new()};
+    rb_hash_aset(args[1], ID2SYM(rb_intern("by")), ID2SYM(rb_intern("distance")));
+    return rb_ary_entry(tree_cut_levels(2, args, self), 0);
+}
+
+/*
+  Builds the Flock.treecluster result hash, cutting the tree into nsets clusters and taking ownership of it. Without
+  a tree, ccluster already holds a flat clustering.
+*/
+static VALUE tree_result(Node *tree, int nelements, int nsets, int *ccluster) {
+    int i;
+    VALUE result  = rb_hash_new();
+    VALUE cluster = rb_ary_new();
+
+    if (tree) {
+        rb_hash_aset(result, ID2SYM(rb_intern("tree")), tree_wrap(tree, nelements));
+        cuttree(nelements, tree, nsets, ccluster);
+    }
+    for (i = 0; i < nelements; i++)
+        rb_ary_push(cluster, INT2NUM(ccluster[i]));
+
+    rb_hash_aset(result, ID2SYM(rb_intern("cluster")), cluster);
+    return result;
+}
+
+/*
+  Clusters the data points through nmicro k-means micro-clusters and builds the Flock.treecluster result hash, with
+  the tree over the micro-clusters and the micro-cluster of each data point. Returns Qnil if out of memory.
+*/
+static VALUE micro_tree_result(int nrows, int ncols, double **cdata, int **cmask, double *cweights, int transpose,
+                               int dist, int method, int nmicro, int nsets, VALUE options, int *ccluster) {
+    int i, nleaves;
+    int nelements = transpose ? ncols : nrows;
+    int assign    = get_int_option(options, "seed", 0);
+    int flat      = get_bool_option(options, "flat", 0);
+    int nnchain   = get_bool_option(options, "nn_chain", 0);
+
+    // the k-means pass takes the convergence options of Flock.kcluster
+    KParams params = {0};
+    read_kparams(options, &params);
+
+    int *cleaf = (int *)malloc(sizeof(int)*nmicro);
+    Node *tree = microtreecluster(nrows, ncols, cdata, cmask, cweights, transpose, dist, method, nnchain, nmicro,
+                                  assign, &params, ccluster, &nleaves);
+    if (!tree) {
+        free(cleaf);
+        return Qnil;
+    }
+
+    // micro-clusters left empty by k-means leave fewer leaves than asked for
+    if (nsets > nleaves)
+        nsets = nleaves;
+    if (flat) {
+        cuttree(nleaves, tree, nsets, cleaf);
+        free(tree);
+        tree = 0;
+    }
+
+    VALUE result   = tree_result(tree, nleaves, nsets, cleaf);
+    VALUE leaves   = rb_hash_aref(result, ID2SYM(rb_intern("cluster")));
+    VALUE cluster  = rb_ary_new();
+    VALUE micro    = rb_ary_new();
+    for (i = 0; i < nelements; i++) {
+        rb_ary_push(cluster, rb_ary_entry(leaves, ccluster[i]));
+        rb_ary_push(micro, INT2NUM(ccluster[i]));
+    }
+
+    rb_hash_aset(result, ID2SYM(rb_intern("cluster")),       cluster);
+    rb_hash_aset(result, ID2SYM(rb_intern("micro_cluster")), micro);
+    free(cleaf);
+    return result;
+}
+
 /* @api private */
 VALUE rb_do_treecluster(int argc, VALUE *argv, VALUE self) {
     VALUE size, data, mask, weights, options;
@@ -306,6 +678,7 @@ VALUE rb_do_treecluster(int argc, VALUE *argv, VALUE self) {
     // m: pairwise maximum- (or complete-) linkage clustering
     // a: pairwise average-linkage clustering
     // c: pairwise centroid-linkage clustering
+    // w: ward's minimum variance linkage clustering
     int method    = get_int_option(options, "method", 'a');
 
     // e = euclidian,
@@ -318,11 +691,23 @@ VALUE rb_do_treecluster(int argc, VALUE *argv, VALUE self) {
     // k = kendall's tau
     int dist      = get_int_option(options, "metric", 'e');
 
+    // nn_chain: faster maximum, average and ward linkage that may order merges at equal distances differently
+    int nnchain   = get_bool_option(options, "nn_chain", 0);
+
+    // on_disk: true or a directory maps the distance matrix from a temporary file
+    VALUE on_disk = get_value_option(options, "on_disk", Qfalse);
+    const char *directory = !RTEST(on_disk) ? 0 : TYPE(on_disk) == T_STRING ? StringValueCStr(on_disk) : "";
+
     int i,j;
     int nrows = RARRAY_LEN(data);
     int ncols = RARRAY_LEN(rb_ary_entry(data, 0));
     int nsets = NUM2INT(rb_Integer(size));
 
+    // micro_clusters: cluster the centroids of this many k-means micro-clusters instead of the data points
+    int nmicro = get_int_option(options, "micro_clusters", 0);
+    if (nmicro && (nmicro < 2 || nmicro < nsets))
+        rb_raise(rb_eArgError, "micro_clusters should be >= 2 and >= size");
+
     double **cdata    = (double**)malloc(sizeof(double*)*nrows);
     int    **cmask    = (int   **)malloc(sizeof(int   *)*nrows);
     double *cweights  = (double *)malloc(sizeof(double )*ncols);
@@ -350,19 +735,30 @@ VALUE rb_do_treecluster(int argc, VALUE *argv, VALUE self) {
 
     ccluster = (int *)malloc(sizeof(int)*dimx);
 
-    Node *tree   = treecluster(nrows, ncols, cdata, cmask, cweights, transpose, dist, method, 0);
-    VALUE result = Qnil, cluster;
-
-    if (tree) {
-        cuttree(dimx, tree, nsets, ccluster);
-
-        result  = rb_hash_new();
-        cluster = rb_ary_new();
-
-        for (i = 0; i < dimx; i++)
-            rb_ary_push(cluster, INT2NUM(ccluster[i]));
-
-        rb_hash_aset(result, ID2SYM(rb_intern("cluster")),   cluster);
+    // single precision distances halve the memory of the distance matrix, single linkage needs none
+    char precision = get_bool_option(options, "float_distances", 0) ? 'f' : 'd';
+    int custom     = (precision == 'f' || directory) && method != 's' && !nmicro;
+    DistanceMatrix *distmatrix = custom
+        ? distancematrix(nrows, ncols, cdata, cmask, cweights, dist, transpose, precision, directory) : 0;
+
+    // flat: only the clusters are needed, the final merges are skipped
+    Node *tree = 0;
+    int  done  = 0;
+    VALUE result = Qnil;
+    if (nmicro)
+        done = (result = micro_tree_result(nrows, ncols, cdata, cmask, cweights, transpose, dist, method, nmicro,
+                                           nsets, options, ccluster)) != Qnil;
+    else {
+        if (!custom || distmatrix) {
+            if (get_bool_option(options, "flat", 0))
+                done = flatcluster(nrows, ncols, cdata, cmask, cweights, transpose, dist, method, distmatrix, nnchain,
+                                   nsets, ccluster);
+            else
+                done = (tree = treecluster(nrows, ncols, cdata, cmask, cweights, transpose, dist, method, distmatrix,
+                                           nnchain)) != 0;
+        }
+        if (done)
+            result = tree_result(tree, dimx, nsets, ccluster);
     }
 
     for (i = 0; i < nrows; i++) {
@@ -374,16 +770,17 @@ VALUE rb_do_treecluster(int argc, VALUE *argv, VALUE self) {
     free(cmask);
     free(cweights);
     free(ccluster);
+    freedistancematrix(distmatrix);
 
-    if (tree)
-        free(tree);
-    else
+    if (!done && custom && !distmatrix && directory)
+        rb_raise(rb_eIOError, "treecluster could not map the distance matrix from a temporary file");
+    else if (!done)
         rb_raise(rb_eNoMemError, "treecluster ran out of memory");
 
     return result;
 }
 
-void inline copy_mask(VALUE src, int *dst, int size, int def) {
+static inline void copy_mask(VALUE src, int *dst, int size, int def) {
     int i;
     if (NIL_P(src))
         for (i = 0; i < size; i++)
@@ -561,6 +958,926 @@ VALUE rb_kendall(int argc, VALUE *argv, VALUE self) {
     return rb_distance(v1, m1, v2, m2, kendall);
 }
 
+/*
+  Document-class: Flock::KMeansModel
+
+  A k-means (or k-medians) model that keeps its centroids in native memory, so that new data can be assigned to
+  clusters or the model retrained without starting from scratch. Data points are always rows: a truthy
+  :transpose raises ArgumentError.
+
+  @example
+    model = Flock::KMeansModel.new(5, data, seed: Flock::SEED_KMEANS_PLUSPLUS)
+    model.predict(rows)     #=> [0, 3, 1, ...]
+    model.refit(new_data)   #=> Hash, same as Flock.kcluster
+*/
+typedef struct {
+    int    nclusters, ncols, method, dist;
+    double **centroid;
+    int    **cmask;
+    double *weights;
+    double error;
+} KMeansModel;
+
+static distance_fn get_distance_fn(int dist) {
+    switch (dist) {
+        case 'b': return cityblock;
+        case 'c': return correlation;
+        case 'a': return acorrelation;
+        case 'u': return ucorrelation;
+        case 'x': return uacorrelation;
+        case 's': return spearman;
+        case 'k': return kendall;
+        default:  return euclid;
+    }
+}
+
+static void kmeans_model_free(void *ptr) {
+    int i;
+    KMeansModel *model = (KMeansModel *)ptr;
+
+    if (model->centroid) {
+        for (i = 0; i < model->nclusters; i++) {
+            free(model->centroid[i]);
+            free(model->cmask[i]);
+        }
+        free(model->centroid);
+        free(model->cmask);
+        free(model->weights);
+    }
+    free(model);
+}
+
+static size_t kmeans_model_memsize(const void *ptr) {
+    const KMeansModel *model = (const KMeansModel *)ptr;
+    return sizeof(KMeansModel) + model->nclusters * model->ncols * (sizeof(double) + sizeof(int));
+}
+
+static const rb_data_type_t kmeans_model_type = {
+    "Flock::KMeansModel",
+    {0, kmeans_model_free, kmeans_model_memsize,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE kmeans_model_allocate(VALUE klass) {
+    KMeansModel *model;
+    return TypedData_Make_Struct(klass, KMeansModel, &kmeans_model_type, model);
+}
+
+static KMeansModel* kmeans_model_get(VALUE self) {
+    KMeansModel *model;
+    TypedData_Get_Struct(self, KMeansModel, &kmeans_model_type, model);
+    if (!model->centroid)
+        rb_raise(rb_eRuntimeError, "uninitialized Flock::KMeansModel");
+    return model;
+}
+
+/*
+  Checks rows of dense data (and an optional mask) for read_rows, converting every value once, so that the
+  errors are raised before anything is allocated.
+*/
+static void check_rows(VALUE data, VALUE mask, int ncols) {
+    int i, j, nrows;
+
+    if (TYPE(data) != T_ARRAY)
+        rb_raise(rb_eArgError, "data should be an array of arrays");
+
+    if (!NIL_P(mask) && (TYPE(mask) != T_ARRAY || RARRAY_LEN(mask) != RARRAY_LEN(data)))
+        rb_raise(rb_eArgError, "mask should be an array of arrays");
+
+    nrows = RARRAY_LEN(data);
+    for (i = 0; i < nrows; i++) {
+        VALUE row = rb_ary_entry(data, i);
+        if (TYPE(row) != T_ARRAY || RARRAY_LEN(row) != ncols)
+            rb_raise(rb_eArgError, "data rows should be arrays of %d numbers", ncols);
+        if (!NIL_P(mask)) {
+            VALUE mrow = rb_ary_entry(mask, i);
+            if (TYPE(mrow) != T_ARRAY || RARRAY_LEN(mrow) != ncols)
+                rb_raise(rb_eArgError, "mask rows should be arrays of %d integers", ncols);
+            for (j = 0; j < ncols; j++)
+                NUM2INT(rb_Integer(rb_ary_entry(mrow, j)));
+        }
+        for (j = 0; j < ncols; j++)
+            NUM2DBL(rb_Float(rb_ary_entry(row, j)));
+    }
+}
+
+/* check_rows for Flock::KMeansModel, which clusters rows only and so rejects transpose. */
+static void check_model_rows(VALUE data, VALUE options, int ncols) {
+    if (get_bool_option(options, "transpose", 0))
+        rb_raise(rb_eArgError, "Flock::KMeansModel clusters rows, transpose is not supported");
+    check_rows(data, get_value_option(options, "mask", Qnil), ncols);
+}
+
+/* Converts rows of dense data (and an optional mask) checked by check_rows into freshly allocated arrays. */
+static void read_rows(VALUE data, VALUE mask, int ncols, double ***pdata, int ***pmask) {
+    int i, j, nrows = RARRAY_LEN(data);
+
+    double **cdata = (double**)malloc(sizeof(double*)*nrows);
+    int    **cmask = (int   **)malloc(sizeof(int   *)*nrows);
+
+    for (i = 0; i < nrows; i++) {
+        cdata[i] = (double*)malloc(sizeof(double)*ncols);
+        cmask[i] = (int   *)malloc(sizeof(int   )*ncols);
+        for (j = 0; j < ncols; j++) {
+            cdata[i][j] = NUM2DBL(rb_Float(rb_ary_entry(rb_ary_entry(data, i), j)));
+            cmask[i][j] = NIL_P(mask) ? 1 : NUM2INT(rb_Integer(rb_ary_entry(rb_ary_entry(mask, i), j)));
+        }
+    }
+
+    *pdata = cdata;
+    *pmask = cmask;
+}
+
+static void free_rows(int nrows, double **data, int **mask) {
+    int i;
+    for (i = 0; i < nrows; i++) {
+        free(data[i]);
+        free(mask[i]);
+    }
+    free(data);
+    free(mask);
+}
+
+static VALUE kmeans_model_centroids(VALUE self);
+
+/* Builds the Flock.kcluster style result hash for the model's current state. */
+static VALUE kmeans_model_result(VALUE self, int nrows, int *ccluster, int ifound, KTrace *trace) {
+    int i, j, k;
+    KMeansModel *model = kmeans_model_get(self);
+    VALUE result     = rb_hash_new();
+    VALUE cluster    = rb_ary_new();
+    VALUE iterations = rb_ary_new();
+    VALUE errors     = rb_ary_new();
+
+    for (i = 0; i < nrows; i++)
+        rb_ary_push(cluster, INT2NUM(ccluster[i]));
+
+    for (i = 0, k = 0; i < trace->npass; i++) {
+        VALUE pass = rb_ary_new();
+        for (j = 0; j < trace->iterations[i] && k < trace->nerrors; j++, k++)
+            rb_ary_push(pass, DBL2NUM(trace->errors[k]));
+        rb_ary_push(iterations, INT2NUM(trace->iterations[i]));
+        rb_ary_push(errors, pass);
+    }
+
+    rb_hash_aset(result, ID2SYM(rb_intern("cluster")),         cluster);
+    rb_hash_aset(result, ID2SYM(rb_intern("centroid")),        kmeans_model_centroids(self));
+    rb_hash_aset(result, ID2SYM(rb_intern("error")),           DBL2NUM(model->error));
+    rb_hash_aset(result, ID2SYM(rb_intern("repeated")),        INT2NUM(ifound));
+    rb_hash_aset(result, ID2SYM(rb_intern("pass_iterations")), iterations);
+    rb_hash_aset(result, ID2SYM(rb_intern("error_trace")),     errors);
+    rb_hash_aset(result, ID2SYM(rb_intern("skipped_terms")),   LONG2NUM(trace->skipped));
+    return result;
+}
+
+typedef struct {
+    KMeansModel *model;
+    int    nrows;
+    double **data;
+    int    **mask;
+    int    *cluster;
+    double *distance;
+} KMeansAssignment;
+
+/* Nearest centroid search for every row, run in parallel and without the GVL. */
+static void* kmeans_model_assign(void *ptr) {
+    int i;
+    KMeansAssignment *assignment = (KMeansAssignment *)ptr;
+    KMeansModel *model = assignment->model;
+    distance_fn metric = get_distance_fn(model->dist);
+
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < assignment->nrows; i++) {
+        int j, best = 0;
+        double distance, closest = metric(model->ncols, assignment->data, model->centroid, assignment->mask,
+                                          model->cmask, model->weights, i, 0, 0);
+        for (j = 1; j < model->nclusters; j++) {
+            distance = metric(model->ncols, assignment->data, model->centroid, assignment->mask,
+                              model->cmask, model->weights, i, j, 0);
+            if (distance < closest) {
+                closest = distance;
+                best    = j;
+            }
+        }
+        assignment->cluster[i]  = best;
+        assignment->distance[i] = closest;
+    }
+
+    return 0;
+}
+
+static void kmeans_model_predict_rows(KMeansModel *model, int nrows, double **cdata, int **cmask,
+                                      int *ccluster, double *cdistance) {
+    KMeansAssignment assignment = {model, nrows, cdata, cmask, ccluster, cdistance};
+    rb_thread_call_without_gvl(kmeans_model_assign, &assignment, RUBY_UBF_PROCESS, 0);
+}
+
+/* Copies the centroids of a kcluster solution into the model. */
+static void kmeans_model_update(KMeansModel *model, int nrows, double **cdata, int **cmask, int *ccluster,
+                                const double *eweight) {
+    getclustercentroids(model->nclusters, nrows, model->ncols, cdata, cmask, ccluster,
+                        model->centroid, model->cmask, 0, model->method, eweight);
+}
+
+/*
+  Fits a k-means or k-medians model on dense data.
+
+  @overload initialize(size, data, options = {})
+    @param [Fixnum] size  number of clusters.
+    @param [Array]  data  dense data, an array of numeric arrays.
+    @param [Hash]   options  :mask, :weights, :iterations, :method, :metric, :seed, :tolerance, :moved_fraction,
+                             :max_iterations, :sample_weights (see Flock#kcluster).
+*/
+static VALUE kmeans_model_initialize(int argc, VALUE *argv, VALUE self) {
+    VALUE size, data, weights, options;
+    KMeansModel *model;
+    rb_scan_args(argc, argv, "21", &size, &data, &options);
+
+    TypedData_Get_Struct(self, KMeansModel, &kmeans_model_type, model);
+
+    if (model->centroid)
+        rb_raise(rb_eRuntimeError, "Flock::KMeansModel already initialized");
+
+    if (TYPE(data) != T_ARRAY || RARRAY_LEN(data) < 1 || TYPE(rb_ary_entry(data, 0)) != T_ARRAY)
+        rb_raise(rb_eArgError, "data should be an array of arrays");
+
+    if (NIL_P(size) || NUM2INT(rb_Integer(size)) < 1 || NUM2INT(rb_Integer(size)) > RARRAY_LEN(data))
+        rb_raise(rb_eArgError, "size should be > 0 and <= data size");
+
+    int i, ifound;
+    int nrows  = RARRAY_LEN(data);
+    int ncols  = RARRAY_LEN(rb_ary_entry(data, 0));
+    int nsets  = NUM2INT(rb_Integer(size));
+    int npass  = get_int_option(options, "iterations", DEFAULT_ITERATIONS);
+    int assign = get_int_option(options, "seed", 0);
+
+    double **cdata, error, *eweight;
+    int    **cmask, *ccluster;
+
+    KTrace  trace  = {0};
+    KParams params = {0};
+    read_kparams(options, &params);
+
+    // everything that can raise comes before the allocations
+    check_model_rows(data, options, ncols);
+    weights = get_value_option(options, "weights", Qnil);
+    if (!NIL_P(weights) && (TYPE(weights) != T_ARRAY || RARRAY_LEN(weights) != ncols))
+        rb_raise(rb_eArgError, "weights should be an array of %d numbers", ncols);
+    for (i = 0; !NIL_P(weights) && i < ncols; i++)
+        NUM2DBL(rb_Float(rb_ary_entry(weights, i)));
+    eweight = get_sample_weights_option(options, nrows);
+    params.trace   = &trace;
+    params.eweight = eweight;
+
+    read_rows(data, get_value_option(options, "mask", Qnil), ncols, &cdata, &cmask);
+
+    model->nclusters = nsets;
+    model->ncols     = ncols;
+    model->method    = get_int_option(options, "method", 'a');
+    model->dist      = get_int_option(options, "metric", 'e');
+    model->weights   = (double  *)malloc(sizeof(double  )*ncols);
+    model->centroid  = (double **)malloc(sizeof(double *)*nsets);
+    model->cmask     = (int    **)malloc(sizeof(int    *)*nsets);
+
+    for (i = 0; i < nsets; i++) {
+        model->centroid[i] = (double*)malloc(sizeof(double)*ncols);
+        model->cmask[i]    = (int   *)malloc(sizeof(int   )*ncols);
+    }
+
+    for (i = 0; i < ncols; i++)
+        model->weights[i] = NIL_P(weights) ? 1.0 : NUM2DBL(rb_Float(rb_ary_entry(weights, i)));
+
+    ccluster = (int *)malloc(sizeof(int)*nrows);
+
+    kcluster(nsets, nrows, ncols, cdata, cmask, model->weights, 0, npass, model->method, model->dist,
+             ccluster, &error, &ifound, assign, &params);
+    kmeans_model_update(model, nrows, cdata, cmask, ccluster, eweight);
+    model->error = error;
+
+    free_rows(nrows, cdata, cmask);
+    free(eweight);
+    free(ccluster);
+    free(trace.iterations);
+    free(trace.errors);
+
+    return self;
+}
+
+/* @api private */
+static VALUE kmeans_model_initialize_copy(VALUE self, VALUE other) {
+    int i;
+    KMeansModel *model, *source = kmeans_model_get(other);
+    TypedData_Get_Struct(self, KMeansModel, &kmeans_model_type, model);
+
+    if (model->centroid)
+        rb_raise(rb_eRuntimeError, "Flock::KMeansModel already initialized");
+
+    *model = *source;
+    model->weights  = (double  *)malloc(sizeof(double  )*model->ncols);
+    model->centroid = (double **)malloc(sizeof(double *)*model->nclusters);
+    model->cmask    = (int    **)malloc(sizeof(int    *)*model->nclusters);
+    memcpy(model->weights, source->weights, sizeof(double)*model->ncols);
+
+    for (i = 0; i < model->nclusters; i++) {
+        model->centroid[i] = (double*)malloc(sizeof(double)*model->ncols);
+        model->cmask[i]    = (int   *)malloc(sizeof(int   )*model->ncols);
+        memcpy(model->centroid[i], source->centroid[i], sizeof(double)*model->ncols);
+        memcpy(model->cmask[i],    source->cmask[i],    sizeof(int   )*model->ncols);
+    }
+
+    return self;
+}
+
+/*
+  Assigns each row to the cluster with the nearest centroid.
+
+  @overload predict(data, options = {})
+    @param [Array] data  dense data, an array of numeric arrays.
+    @param [Hash]  options  :mask (see Flock#kcluster).
+    @return [Array] cluster index for each row.
+*/
+static VALUE kmeans_model_predict(int argc, VALUE *argv, VALUE self) {
+    VALUE data, options, cluster;
+    rb_scan_args(argc, argv, "11", &data, &options);
+
+    int i;
+    KMeansModel *model = kmeans_model_get(self);
+    double **cdata, *cdistance;
+    int    **cmask, *ccluster, nrows;
+
+    check_model_rows(data, options, model->ncols);
+    read_rows(data, get_value_option(options, "mask", Qnil), model->ncols, &cdata, &cmask);
+    nrows     = RARRAY_LEN(data);
+    ccluster  = (int   *)malloc(sizeof(int   )*nrows);
+    cdistance = (double*)malloc(sizeof(double)*nrows);
+
+    kmeans_model_predict_rows(model, nrows, cdata, cmask, ccluster, cdistance);
+
+    cluster = rb_ary_new2(nrows);
+    for (i = 0; i < nrows; i++)
+        rb_ary_push(cluster, INT2NUM(ccluster[i]));
+
+    free_rows(nrows, cdata, cmask);
+    free(ccluster);
+    free(cdistance);
+
+    return cluster;
+}
+
+/*
+  Retrains the model on new data, resuming from the current centroids instead of a fresh seeding. Rows are first
+  assigned to their nearest centroid and a single k-means (or k-medians) pass continues from there.
+
+  @overload refit(data, options = {})
+    @param [Array] data  dense data, an array of numeric arrays.
+    @param [Hash]  options  :mask, :tolerance, :moved_fraction, :max_iterations, :sample_weights
+                            (see Flock#kcluster).
+    @return [Hash] same as Flock#kcluster.
+*/
+static VALUE kmeans_model_refit(int argc, VALUE *argv, VALUE self) {
+    VALUE data, options, result;
+    rb_scan_args(argc, argv, "11", &data, &options);
+
+    int i, j, ifound, nrows, *ccluster, *counts;
+    KMeansModel *model = kmeans_model_get(self);
+    double **cdata, *cdistance, error;
+    int    **cmask;
+
+    if (TYPE(data) != T_ARRAY || RARRAY_LEN(data) < model->nclusters)
+        rb_raise(rb_eArgError, "data should be an array of at least %d arrays", model->nclusters);
+
+    KTrace  trace  = {0};
+    KParams params = {0};
+    read_kparams(options, &params);
+
+    // everything that can raise comes before the allocations
+    check_model_rows(data, options, model->ncols);
+    double *eweight = get_sample_weights_option(options, RARRAY_LEN(data));
+    params.trace   = &trace;
+    params.eweight = eweight;
+
+    read_rows(data, get_value_option(options, "mask", Qnil), model->ncols, &cdata, &cmask);
+    nrows     = RARRAY_LEN(data);
+    ccluster  = (int   *)malloc(sizeof(int   )*nrows);
+    cdistance = (double*)malloc(sizeof(double)*nrows);
+    counts    = (int   *)calloc(model->nclusters, sizeof(int));
+
+    kmeans_model_predict_rows(model, nrows, cdata, cmask, ccluster, cdistance);
+
+    // kcluster needs every cluster populated, so empty clusters take over the worst fitting rows.
+    for (i = 0; i < nrows; i++)
+        counts[ccluster[i]]++;
+
+    for (j = 0; j < model->nclusters; j++) {
+        int worst = -1;
+        if (counts[j] > 0) continue;
+        for (i = 0; i < nrows; i++) {
+            if (counts[ccluster[i]] > 1 && (worst < 0 || cdistance[i] > cdistance[worst]))
+                worst = i;
+        }
+        counts[ccluster[worst]]--;
+        counts[j]++;
+        ccluster[worst]  = j;
+        cdistance[worst] = 0;
+    }
+
+    kcluster(model->nclusters, nrows, model->ncols, cdata, cmask, model->weights, 0, 0, model->method,
+             model->dist, ccluster, &error, &ifound, 0, &params);
+    kmeans_model_update(model, nrows, cdata, cmask, ccluster, eweight);
+    model->error = error;
+
+    result = kmeans_model_result(self, nrows, ccluster, ifound, &trace);
+
+    free_rows(nrows, cdata, cmask);
+    free(eweight);
+    free(ccluster);
+    free(cdistance);
+    free(counts);
+    free(trace.iterations);
+    free(trace.errors);
+
+    return result;
+}
+
+/*
+  @return [Array<Array>] cluster centroids.
+*/
+static VALUE kmeans_model_centroids(VALUE self) {
+    int i, j;
+    KMeansModel *model = kmeans_model_get(self);
+    VALUE centroid = rb_ary_new();
+
+    for (i = 0; i < model->nclusters; i++) {
+        VALUE point = rb_ary_new();
+        for (j = 0; j < model->ncols; j++)
+            rb_ary_push(point, DBL2NUM(model->centroid[i][j]));
+        rb_ary_push(centroid, point);
+    }
+
+    return centroid;
+}
+
+/*
+  @return [Fixnum] number of clusters.
+*/
+static VALUE kmeans_model_size(VALUE self) {
+    return INT2NUM(kmeans_model_get(self)->nclusters);
+}
+
+/*
+  @return [Numeric] error of the last fit or refit.
+*/
+static VALUE kmeans_model_error(VALUE self) {
+    return DBL2NUM(kmeans_model_get(self)->error);
+}
+
+/*
+  Document-class: Flock::DistanceMatrix
+
+  The pairwise distances between data points, computed once in native memory (in parallel) and shared by
+  hierarchical clustering, k-medoids and silhouette scoring. Only the lower triangle is stored: d(1,0), d(2,0),
+  d(2,1), d(3,0), ...
+
+  @example
+    matrix = Flock::DistanceMatrix.new(data, metric: Flock::METRIC_CITY_BLOCK)
+    Flock.treecluster(5, matrix, method: Flock::METHOD_MAXIMUM_LINKAGE)  #=> Hash, same as Flock.treecluster
+    result = Flock.kmedoids(5, matrix)
+    Flock.silhouette(matrix, result[:cluster])
+*/
+typedef struct {
+    DistanceMatrix *matrix;
+    char *directory;    /* where copies of an on-disk matrix are mapped, NULL in memory */
+    int  metric;        /* metric the distances were computed with, 0 if not known */
+} DistanceMatrixData;
+
+// bytes in the buffer of the matrix, in tiles if it is on disk.
+static size_t distance_matrix_bytes(const DistanceMatrix *matrix) {
+    return distancecount(matrix->n, matrix->blocked) * (matrix->precision == 'f' ? sizeof(float) : sizeof(double));
+}
+
+static void distance_matrix_free(void *ptr) {
+    DistanceMatrixData *data = (DistanceMatrixData *)ptr;
+    freedistancematrix(data->matrix);
+    free(data->directory);
+    free(data);
+}
+
+static size_t distance_matrix_memsize(const void *ptr) {
+    const DistanceMatrixData *data = (const DistanceMatrixData *)ptr;
+    if (!data->matrix || data->matrix->mapped)
+        return sizeof(DistanceMatrixData);
+    return sizeof(DistanceMatrixData) + sizeof(DistanceMatrix) + distance_matrix_bytes(data->matrix);
+}
+
+static const rb_data_type_t distance_matrix_type = {
+    "Flock::DistanceMatrix",
+    {0, distance_matrix_free, distance_matrix_memsize,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE distance_matrix_allocate(VALUE klass) {
+    DistanceMatrixData *data;
+    return TypedData_Make_Struct(klass, DistanceMatrixData, &distance_matrix_type, data);
+}
+
+static DistanceMatrixData* distance_matrix_data(VALUE self) {
+    DistanceMatrixData *data;
+    TypedData_Get_Struct(self, DistanceMatrixData, &distance_matrix_type, data);
+    return data;
+}
+
+static DistanceMatrix* distance_matrix_get(VALUE self) {
+    DistanceMatrixData *data = distance_matrix_data(self);
+    if (!data->matrix)
+        rb_raise(rb_eRuntimeError, "uninitialized Flock::DistanceMatrix");
+    return data->matrix;
+}
+
+/* Checks that an uninitialized matrix is set up, and reads the float_distances, on_disk and metric options. */
+static DistanceMatrixData* distance_matrix_setup(VALUE self, VALUE options, char *precision) {
+    DistanceMatrixData *data = distance_matrix_data(self);
+    VALUE on_disk = get_value_option(options, "on_disk", Qfalse);
+
+    if (data->matrix)
+        rb_raise(rb_eRuntimeError, "Flock::DistanceMatrix already initialized");
+
+    *precision   = get_bool_option(options, "float_distances", 0) ? 'f' : 'd';
+    data->metric = get_int_option(options, "metric", 0);
+    free(data->directory);
+    data->directory = 0;
+    if (RTEST(on_disk))
+        data->directory = strdup(TYPE(on_disk) == T_STRING ? StringValueCStr(on_disk) : "");
+    return data;
+}
+
+static void distance_matrix_failed(DistanceMatrixData *data) {
+    if (data->directory)
+        rb_raise(rb_eIOError, "could not map the distance matrix from a temporary file");
+    rb_raise(rb_eNoMemError, "distance matrix ran out of memory");
+}
+
+/* Returns a copy of the matrix, kept on disk (in the same directory) if the matrix is, or NULL on failure. */
+static DistanceMatrix* distance_matrix_copy(DistanceMatrixData *data) {
+    DistanceMatrix *copy = newdistancematrix(data->matrix->n, data->matrix->precision, data->directory);
+    if (copy)
+        memcpy(copy->values, data->matrix->values, distance_matrix_bytes(data->matrix));
+    return copy;
+}
+
+typedef struct {
+    int    nrows, ncols, transpose, dist;
+    double **data;
+    int    **mask;
+    double *weights;
+    char   precision;
+    const char *directory;
+    DistanceMatrix *matrix;
+} DistanceMatrixJob;
+
+/* Computes the distance matrix, in parallel and without the GVL. */
+static void* distance_matrix_compute(void *ptr) {
+    DistanceMatrixJob *job = (DistanceMatrixJob *)ptr;
+    job->matrix = distancematrix(job->nrows, job->ncols, job->data, job->mask, job->weights, job->dist,
+                                 job->transpose, job->precision, job->directory);
+    return 0;
+}
+
+/*
+  Computes the distances between the rows (or columns) of dense data.
+
+  @overload initialize(data, options = {})
+    @param [Array] data  dense data, an array of numeric arrays.
+    @param [Hash]  options  :mask, :weights, :transpose, :metric (see Flock#kcluster), :float_distances and
+                            :on_disk (see Flock#treecluster).
+*/
+static VALUE distance_matrix_initialize(int argc, VALUE *argv, VALUE self) {
+    VALUE data, options, weights;
+    rb_scan_args(argc, argv, "11", &data, &options);
+
+    if (TYPE(data) != T_ARRAY || RARRAY_LEN(data) < 1 || TYPE(rb_ary_entry(data, 0)) != T_ARRAY)
+        rb_raise(rb_eArgError, "data should be an array of arrays");
+
+    int i;
+    char precision;
+    DistanceMatrixData *matrix = distance_matrix_setup(self, options, &precision);
+    DistanceMatrixJob job = {0};
+
+    job.nrows     = RARRAY_LEN(data);
+    job.ncols     = RARRAY_LEN(rb_ary_entry(data, 0));
+    job.transpose = get_bool_option(options, "transpose", 0);
+    job.dist      = get_int_option(options, "metric", 'e');
+    matrix->metric = job.dist;
+
+    int nelements = job.transpose ? job.ncols : job.nrows;
+    int ndata     = job.transpose ? job.nrows : job.ncols;
+
+    if (nelements < 2)
+        rb_raise(rb_eArgError, "data should have at least 2 data points");
+
+    weights = get_value_option(options, "weights", Qnil);
+    if (!NIL_P(weights) && (TYPE(weights) != T_ARRAY || RARRAY_LEN(weights) != ndata))
+        rb_raise(rb_eArgError, "weights should be an array of %d numbers", ndata);
+
+    check_rows(data, get_value_option(options, "mask", Qnil), job.ncols);
+    read_rows(data, get_value_option(options, "mask", Qnil), job.ncols, &job.data, &job.mask);
+
+    job.weights   = (double *)malloc(sizeof(double)*ndata);
+    job.precision = precision;
+    job.directory = matrix->directory;
+    for (i = 0; i < ndata; i++)
+        job.weights[i] = NIL_P(weights) ? 1.0 : NUM2DBL(rb_Float(rb_ary_entry(weights, i)));
+
+    rb_thread_call_without_gvl(distance_matrix_compute, &job, RUBY_UBF_PROCESS, 0);
+
+    free_rows(job.nrows, job.data, job.mask);
+    free(job.weights);
+
+    if (!job.matrix)
+        distance_matrix_failed(matrix);
+    matrix->matrix = job.matrix;
+    return self;
+}
+
+/*
+  Loads precomputed distances: the lower triangle d(1,0), d(2,0), d(2,1), d(3,0), ... of a matrix between n data
+  points, n*(n-1)/2 values in all.
+
+  @overload load(distances, options = {})
+    @param [Array, String] distances  the distances as numbers, or packed as native doubles ('D*'), or floats
+                                      ('F*') with :float_distances.
+    @param [Hash]          options    :float_distances and :on_disk (see Flock#treecluster), and :metric, the
+                                      metric the distances were computed with (see #metric).
+    @return [Flock::DistanceMatrix]
+*/
+static VALUE distance_matrix_load(int argc, VALUE *argv, VALUE klass) {
+    VALUE distances, options;
+    rb_scan_args(argc, argv, "11", &distances, &options);
+
+    if (TYPE(distances) != T_ARRAY && TYPE(distances) != T_STRING)
+        rb_raise(rb_eArgError, "distances should be an array or a packed string");
+
+    char precision;
+    VALUE self = distance_matrix_allocate(klass);
+    DistanceMatrixData *matrix = distance_matrix_setup(self, options, &precision);
+    size_t size  = precision == 'f' ? sizeof(float) : sizeof(double);
+    size_t count = TYPE(distances) == T_ARRAY ? (size_t)RARRAY_LEN(distances) : RSTRING_LEN(distances) / size;
+    long   i, n  = (long)((1 + sqrt(1 + 8.0 * count)) / 2);
+
+    if (TYPE(distances) == T_STRING && RSTRING_LEN(distances) % size)
+        rb_raise(rb_eArgError, "distances should be packed as %s", precision == 'f' ? "floats" : "doubles");
+    if (n < 2 || n > INT_MAX || (size_t)n * (n - 1) / 2 != count)
+        rb_raise(rb_eArgError, "%ld distances do not form the lower triangle of a matrix", (long)count);
+
+    matrix->matrix = newdistancematrix((int)n, precision, matrix->directory);
+    if (!matrix->matrix)
+        distance_matrix_failed(matrix);
+
+    if (TYPE(distances) == T_STRING && !matrix->matrix->blocked)
+        memcpy(matrix->matrix->values, RSTRING_PTR(distances), count * size);
+    else if (TYPE(distances) == T_STRING) {
+        // on disk, the distances go to their tiles row after row of the lower triangle.
+        const char *packed = RSTRING_PTR(distances);
+        long j, k = 0;
+        for (i = 1; i < n; i++)
+            for (j = 0; j < i; j++, k++)
+                setdistance(matrix->matrix, (int)i, (int)j,
+                            precision == 'f' ? ((const float *)packed)[k] : ((const double *)packed)[k]);
+    }
+    else {
+        long j, k = 0;
+        for (i = 1; i < n; i++)
+            for (j = 0; j < i; j++, k++)
+                setdistance(matrix->matrix, (int)i, (int)j, NUM2DBL(rb_Float(rb_ary_entry(distances, k))));
+    }
+
+    return self;
+}
+
+/* @api private */
+static VALUE distance_matrix_initialize_copy(VALUE self, VALUE other) {
+    DistanceMatrixData *matrix = distance_matrix_data(self), *source = distance_matrix_data(other);
+    distance_matrix_get(other);
+
+    if (matrix->matrix)
+        rb_raise(rb_eRuntimeError, "Flock::DistanceMatrix already initialized");
+
+    matrix->directory = source->directory ? strdup(source->directory) : 0;
+    matrix->metric    = source->metric;
+    matrix->matrix    = distance_matrix_copy(source);
+    if (!matrix->matrix)
+        distance_matrix_failed(matrix);
+    return self;
+}
+
+/*
+  @return [Fixnum] number of data points.
+*/
+static VALUE distance_matrix_size(VALUE self) {
+    return INT2NUM(distance_matrix_get(self)->n);
+}
+
+/*
+  @return [true, false] whether the distances are stored as single precision floats.
+*/
+static VALUE distance_matrix_float(VALUE self) {
+    return distance_matrix_get(self)->precision == 'f' ? Qtrue : Qfalse;
+}
+
+/*
+  @return [Fixnum, nil] metric the distances were computed with, or given to Flock::DistanceMatrix.load, nil if
+                        unknown. #dump holds the distances only, so pass it back to load as :metric.
+*/
+static VALUE distance_matrix_metric(VALUE self) {
+    int metric = distance_matrix_data(self)->metric;
+    distance_matrix_get(self);
+    return metric ? INT2NUM(metric) : Qnil;
+}
+
+/*
+  @overload [](i, j)
+    @return [Numeric] distance between data points i and j.
+*/
+static VALUE distance_matrix_aref(VALUE self, VALUE vi, VALUE vj) {
+    DistanceMatrix *matrix = distance_matrix_get(self);
+    int i = NUM2INT(vi), j = NUM2INT(vj);
+
+    if (i < 0 || j < 0 || i >= matrix->n || j >= matrix->n)
+        rb_raise(rb_eIndexError, "index out of range for %d data points", matrix->n);
+    return DBL2NUM(i == j ? 0 : getdistance(matrix, i, j));
+}
+
+/*
+  @return [String] the lower triangle packed as native doubles, or floats, for Flock::DistanceMatrix.load.
+*/
+static VALUE distance_matrix_dump(VALUE self) {
+    DistanceMatrix *matrix = distance_matrix_get(self);
+    size_t size = matrix->precision == 'f' ? sizeof(float) : sizeof(double), k = 0;
+    int i, j;
+    VALUE dump;
+
+    if (!matrix->blocked)
+        return rb_str_new((const char *)matrix->values, distance_matrix_bytes(matrix));
+
+    // on disk, the tiles are read back row after row of the lower triangle.
+    dump = rb_str_new(0, (long)((size_t)matrix->n * (matrix->n - 1) / 2 * size));
+    for (i = 1; i < matrix->n; i++) {
+        for (j = 0; j < i; j++, k++) {
+            if (matrix->precision == 'f')
+                ((float *)RSTRING_PTR(dump))[k] = (float)getdistance(matrix, i, j);
+            else
+                ((double *)RSTRING_PTR(dump))[k] = getdistance(matrix, i, j);
+        }
+    }
+    return dump;
+}
+
+/* @api private */
+VALUE rb_do_matrix_treecluster(int argc, VALUE *argv, VALUE self) {
+    VALUE size, distances, options;
+    rb_scan_args(argc, argv, "21", &size, &distances, &options);
+
+    DistanceMatrixData *matrix = distance_matrix_data(distances);
+    int n      = distance_matrix_get(distances)->n;
+    int nsets  = NUM2INT(rb_Integer(size));
+    int method  = get_int_option(options, "method", 'a');
+    int nnchain = get_bool_option(options, "nn_chain", 0);
+
+    if (nsets < 1 || nsets > n)
+        rb_raise(rb_eArgError, "size should be > 0 and <= data size");
+    if (method == 'c')
+        rb_raise(rb_eArgError, "centroid linkage needs the data, not a distance matrix");
+    // the ward update is exact for the squared euclidean distances of METRIC_EUCLIDIAN only
+    if (method == 'w' && matrix->metric != 'e')
+        rb_raise(rb_eArgError, "ward linkage needs a distance matrix with metric: Flock::METRIC_EUCLIDIAN");
+
+    // single linkage only reads the matrix, the other linkages overwrite their own copy
+    DistanceMatrix *distmatrix = method == 's' ? matrix->matrix : distance_matrix_copy(matrix);
+    if (!distmatrix)
+        distance_matrix_failed(matrix);
+
+    Node *tree     = 0;
+    int  *ccluster = (int *)malloc(sizeof(int)*n);
+    int   done     = get_bool_option(options, "flat", 0)
+        ? flatcluster(n, 0, 0, 0, 0, 0, 'e', method, distmatrix, nnchain, nsets, ccluster)
+        : (tree = treecluster(n, 0, 0, 0, 0, 0, 'e', method, distmatrix, nnchain)) != 0;
+    VALUE result   = done ? tree_result(tree, n, nsets, ccluster) : Qnil;
+
+    if (distmatrix != matrix->matrix)
+        freedistancematrix(distmatrix);
+    free(ccluster);
+
+    if (!done)
+        rb_raise(rb_eNoMemError, "treecluster ran out of memory");
+
+    return result;
+}
+
+/* @api private */
+VALUE rb_do_kmedoids(int argc, VALUE *argv, VALUE self) {
+    VALUE size, distances, options;
+    rb_scan_args(argc, argv, "21", &size, &distances, &options);
+
+    DistanceMatrix *matrix = distance_matrix_get(distances);
+    int i, ifound, n = matrix->n;
+    int nsets = NUM2INT(rb_Integer(size));
+    int npass = get_int_option(options, "iterations", DEFAULT_ITERATIONS);
+    double error;
+
+    if (nsets < 1 || nsets > n)
+        rb_raise(rb_eArgError, "size should be > 0 and <= data size");
+
+    int *ccluster = (int *)malloc(sizeof(int)*n);
+    int *index    = (int *)malloc(sizeof(int)*n);
+
+    kmedoids(nsets, n, matrix, npass < 1 ? 1 : npass, ccluster, &error, &ifound, get_seed_option(options));
+
+    if (ifound < 0) {
+        free(ccluster);
+        free(index);
+        rb_raise(rb_eNoMemError, "kmedoids ran out of memory");
+    }
+
+    // kmedoids labels each data point with its medoid, number the clusters in order of appearance instead
+    VALUE result  = rb_hash_new();
+    VALUE cluster = rb_ary_new2(n);
+    VALUE medoid  = rb_ary_new2(nsets);
+
+    for (i = 0; i < n; i++)
+        index[i] = -1;
+    for (i = 0; i < n; i++) {
+        if (index[ccluster[i]] < 0) {
+            index[ccluster[i]] = RARRAY_LEN(medoid);
+            rb_ary_push(medoid, INT2NUM(ccluster[i]));
+        }
+        rb_ary_push(cluster, INT2NUM(index[ccluster[i]]));
+    }
+
+    rb_hash_aset(result, ID2SYM(rb_intern("cluster")),  cluster);
+    rb_hash_aset(result, ID2SYM(rb_intern("medoid")),   medoid);
+    rb_hash_aset(result, ID2SYM(rb_intern("error")),    DBL2NUM(error));
+    rb_hash_aset(result, ID2SYM(rb_intern("repeated")), INT2NUM(ifound));
+
+    free(ccluster);
+    free(index);
+
+    return result;
+}
+
+typedef struct {
+    DistanceMatrix *matrix;
+    int    nclusters, *cluster, status;
+    double *values, score;
+} SilhouetteJob;
+
+/* Scores every data point, in parallel and without the GVL. */
+static void* silhouette_compute(void *ptr) {
+    SilhouetteJob *job = (SilhouetteJob *)ptr;
+    job->status = silhouette(job->nclusters, job->matrix, job->cluster, job->values, &job->score);
+    return 0;
+}
+
+/* @api private */
+VALUE rb_do_silhouette(VALUE self, VALUE distances, VALUE cluster, VALUE size) {
+    SilhouetteJob job = {0};
+    int i, n;
+
+    job.matrix    = distance_matrix_get(distances);
+    job.nclusters = NUM2INT(size);
+    n             = job.matrix->n;
+
+    if (TYPE(cluster) != T_ARRAY || RARRAY_LEN(cluster) != n)
+        rb_raise(rb_eArgError, "cluster should be an array of %d cluster numbers", n);
+    for (i = 0; i < n; i++) {
+        int id = NUM2INT(rb_ary_entry(cluster, i));
+        if (id < 0 || id >= job.nclusters)
+            rb_raise(rb_eArgError, "cluster numbers should be >= 0 and < %d", job.nclusters);
+    }
+
+    job.cluster = (int   *)malloc(sizeof(int   )*n);
+    job.values  = (double*)malloc(sizeof(double)*n);
+    for (i = 0; i < n; i++)
+        job.cluster[i] = NUM2INT(rb_ary_entry(cluster, i));
+
+    rb_thread_call_without_gvl(silhouette_compute, &job, RUBY_UBF_PROCESS, 0);
+
+    VALUE result = Qnil, values;
+    if (job.status) {
+        result = rb_hash_new();
+        values = rb_ary_new2(n);
+        for (i = 0; i < n; i++)
+            rb_ary_push(values, DBL2NUM(job.values[i]));
+        rb_hash_aset(result, ID2SYM(rb_intern("score")),  DBL2NUM(job.score));
+        rb_hash_aset(result, ID2SYM(rb_intern("values")), values);
+    }
+
+    free(job.cluster);
+    free(job.values);
+
+    if (!job.status)
+        rb_raise(rb_eNoMemError, "silhouette ran out of memory");
+
+    return result;
+}
 
 void Init_flock(void) {
     mFlock  = rb_define_module("Flock");
@@ -569,6 +1886,40 @@ void Init_flock(void) {
     rb_define_private_method(scFlock, "do_kcluster",            RUBY_METHOD_FUNC(rb_do_kcluster),            -1);
     rb_define_private_method(scFlock, "do_self_organizing_map", RUBY_METHOD_FUNC(rb_do_self_organizing_map), -1);
     rb_define_private_method(scFlock, "do_treecluster",         RUBY_METHOD_FUNC(rb_do_treecluster),         -1);
+    rb_define_private_method(scFlock, "do_matrix_treecluster",  RUBY_METHOD_FUNC(rb_do_matrix_treecluster),  -1);
+    rb_define_private_method(scFlock, "do_kmedoids",            RUBY_METHOD_FUNC(rb_do_kmedoids),            -1);
+    rb_define_private_method(scFlock, "do_silhouette",          RUBY_METHOD_FUNC(rb_do_silhouette),           3);
+
+    cKMeansModel = rb_define_class_under(mFlock, "KMeansModel", rb_cObject);
+    rb_define_alloc_func(cKMeansModel, kmeans_model_allocate);
+    rb_define_method(cKMeansModel, "initialize", RUBY_METHOD_FUNC(kmeans_model_initialize), -1);
+    rb_define_method(cKMeansModel, "initialize_copy", RUBY_METHOD_FUNC(kmeans_model_initialize_copy), 1);
+    rb_define_method(cKMeansModel, "predict",    RUBY_METHOD_FUNC(kmeans_model_predict),    -1);
+    rb_define_method(cKMeansModel, "refit",      RUBY_METHOD_FUNC(kmeans_model_refit),      -1);
+    rb_define_method(cKMeansModel, "centroids",  RUBY_METHOD_FUNC(kmeans_model_centroids),   0);
+    rb_define_method(cKMeansModel, "size",       RUBY_METHOD_FUNC(kmeans_model_size),        0);
+    rb_define_method(cKMeansModel, "error",      RUBY_METHOD_FUNC(kmeans_model_error),       0);
+
+    cDistanceMatrix = rb_define_class_under(mFlock, "DistanceMatrix", rb_cObject);
+    rb_define_alloc_func(cDistanceMatrix, distance_matrix_allocate);
+    rb_define_singleton_method(cDistanceMatrix, "load", RUBY_METHOD_FUNC(distance_matrix_load), -1);
+    rb_define_method(cDistanceMatrix, "initialize", RUBY_METHOD_FUNC(distance_matrix_initialize), -1);
+    rb_define_method(cDistanceMatrix, "initialize_copy", RUBY_METHOD_FUNC(distance_matrix_initialize_copy), 1);
+    rb_define_method(cDistanceMatrix, "size",       RUBY_METHOD_FUNC(distance_matrix_size),      0);
+    rb_define_method(cDistanceMatrix, "float?",     RUBY_METHOD_FUNC(distance_matrix_float),     0);
+    rb_define_method(cDistanceMatrix, "metric",     RUBY_METHOD_FUNC(distance_matrix_metric),    0);
+    rb_define_method(cDistanceMatrix, "[]",         RUBY_METHOD_FUNC(distance_matrix_aref),      2);
+    rb_define_method(cDistanceMatrix, "dump",       RUBY_METHOD_FUNC(distance_matrix_dump),      0);
+
+    cTree = rb_define_class_under(mFlock, "Tree", rb_cObject);
+    rb_define_alloc_func(cTree, tree_allocate);
+    rb_define_method(cTree, "initialize",      RUBY_METHOD_FUNC(tree_initialize),      1);
+    rb_define_method(cTree, "initialize_copy", RUBY_METHOD_FUNC(tree_initialize_copy), 1);
+    rb_define_method(cTree, "size",            RUBY_METHOD_FUNC(tree_size),            0);
+    rb_define_method(cTree, "to_a",            RUBY_METHOD_FUNC(tree_to_a),            0);
+    rb_define_method(cTree, "cut",             RUBY_METHOD_FUNC(tree_cut),             1);
+    rb_define_method(cTree, "cut_distance",    RUBY_METHOD_FUNC(tree_cut_distance),    1);
+    rb_define_method(cTree, "cut_levels",      RUBY_METHOD_FUNC(tree_cut_levels),     -1);
 
     /* kcluster method - K-Means */
     rb_define_const(mFlock, "METHOD_AVERAGE", INT2NUM('a'));
@@ -584,6 +1935,8 @@ void Init_flock(void) {
     rb_define_const(mFlock, "METHOD_AVERAGE_LINKAGE",  INT2NUM('a'));
     /* treecluster method - pairwise centroid-linkage clustering */
     rb_define_const(mFlock, "METHOD_CENTROID_LINKAGE", INT2NUM('c'));
+    /* treecluster method - Ward's minimum variance linkage clustering */
+    rb_define_const(mFlock, "METHOD_WARD_LINKAGE",     INT2NUM('w'));
 
 
     rb_define_const(mFlock, "METRIC_EUCLIDIAN",                       INT2NUM('e'));
@@ -610,6 +1963,24 @@ void Init_flock(void) {
     */
     rb_define_const(mFlock, "SEED_SPREADOUT",       INT2NUM(2));
 
+    /*
+        K-Means|| (scalable K-Means++) initialization: candidates are oversampled in a few rounds that
+        compute distances in parallel, then reduced to the initial clusters with K-Means++.
+    */
+    rb_define_const(mFlock, "SEED_KMEANS_PARALLEL", INT2NUM(3));
+
+    /*
+        AFK-MC2 initialization: K-Means++ approximated by Markov chains of :chain_length proposals, with a
+        cost that grows sublinearly with the number of data points.
+    */
+    rb_define_const(mFlock, "SEED_AFKMC2",          INT2NUM(4));
+
+    /*
+        Deterministic PCA-part initialization: the cluster with the largest spread is split in turn along
+        its principal axis. With self_organizing_map, nodes are spread over the first two principal axes.
+    */
+    rb_define_const(mFlock, "SEED_PCA",             INT2NUM(5));
+
     rb_define_module_function(mFlock, "euclidian_distance", RUBY_METHOD_FUNC(rb_euclid), -1);
     rb_define_module_function(mFlock, "cityblock_distance", RUBY_METHOD_FUNC(rb_cityblock), -1);
     rb_define_module_function(mFlock, "correlation_distance", RUBY_METHOD_FUNC(rb_correlation), -1);
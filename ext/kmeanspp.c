@@ -1,129 +1,849 @@
 #include <stdlib.h>
+#include <math.h>
+#include "cluster.h"
 
-extern double uniform();
-typedef struct clusterpoint {
-    double dist;
-    int n, chosen, closest;
-}   clusterpoint;
+// update each point's distance to its closest center with the newest centers only. returns the sum of the squared
+// distances, each counted eweight[i] times (once if eweight is NULL).
+double update_distances(int ndata, int npoints,
+                        double **data, int **mask, double weight[], int transpose, const double eweight[],
+                        int ncenters, const int centers[], double mindist[], int closest[],
+                        double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int)) {
 
-int compare(const void *ptr1, const void *ptr2) {
-    clusterpoint *p1 = (clusterpoint *)ptr1, *p2 = (clusterpoint *)ptr2;
-    return p1->dist == p2->dist ? 0 : p1->dist < p2->dist ? -1 : 1;
+    int i, j;
+    double total = 0;
+
+    #pragma omp parallel for private(j) schedule(static)
+    for (i = 0; i < npoints; i++) {
+        for (j = 0; j < ncenters; j++) {
+            double dist = metric(ndata, data, data, mask, mask, weight, i, centers[j], transpose);
+            if (closest[i] < 0 || dist < mindist[i]) {
+                mindist[i] = dist;
+                closest[i] = centers[j];
+            }
+        }
+    }
+    // summed in point order, so that the draws do not depend on the number of threads.
+    for (i = 0; i < npoints; i++)
+        total += (eweight ? eweight[i] : 1) * mindist[i] * mindist[i];
+
+    return total;
 }
 
-double compute_distances(int ndata, int npoints,
-                         double **data, int **mask, double weight[], int transpose, clusterpoint dists[],
-                         double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int)) {
+// pick the first center uniformly, or with probability proportional to its weight if eweight is not NULL.
+int select_first(RandomState* random, int npoints, const double eweight[]) {
+    int i;
+    double total = 0, curr = 0, cutoff;
 
-    int i, j, closest = 0;
-    double min, dist, total = 0;
+    if (!eweight) return (int)((double)npoints*uniform(random));
+
+    for (i = 0; i < npoints; i++)
+        total += eweight[i];
+    cutoff = total * uniform(random);
+    for (i = 0; i < npoints - 1; i++) {
+        curr += eweight[i];
+        if (curr >= cutoff) break;
+    }
+
+    return i;
+}
+
+// pick a point not yet chosen with probability proportional to its weight (1 if weights is NULL) times the
+// square of its distance from the closest center, scanning a running sum against a single uniform draw. falls
+// back to the last point not chosen if all remaining points coincide with a center.
+int select_weighted(RandomState* random, int npoints, const double mindist[], const double weights[],
+                    const int chosen[], double total) {
+    int i, last = -1;
+    double curr = 0, cutoff = total * uniform(random);
 
-    // compute distances to chosen point
     for (i = 0; i < npoints; i++) {
-        if (dists[i].chosen) continue;
+        double w;
+        if (chosen[i] >= 0) continue;
+        last  = i;
+        w     = (weights ? weights[i] : 1) * mindist[i] * mindist[i];
+        curr += w;
+        if (curr >= cutoff && w > 0)
+            return i;
+    }
 
-        min = -1;
-        for (j = 0; j < npoints; j++) {
-            if (!dists[j].chosen) continue;
+    return last;
+}
+
+#define GREEDY_BLOCK 256
+
+// greedy k-means++: draw ntrials candidates as select_weighted would and return the one that leaves the smallest
+// sum of squared distances from the points to their closest center. the potentials of all candidates are
+// accumulated in one parallel pass over fixed blocks of GREEDY_BLOCK points, whose partial sums are added in block
+// order so that the choice does not depend on the number of threads (serially if the partials cannot be allocated).
+int select_greedy(RandomState* random, int ntrials, int ndata, int npoints,
+                  double** data, int** mask, double weight[], int transpose, const double eweight[],
+                  const double mindist[], const int clusterid[], double total, int trials[], double potential[],
+                  double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int)) {
+
+    int b, i, t, best = 0;
+    const int nblocks = (npoints + GREEDY_BLOCK - 1) / GREEDY_BLOCK;
+    double *partial = calloc((size_t)nblocks * ntrials, sizeof(double));
 
-            dist = metric(ndata, data, data, mask, mask, weight, dists[i].n, dists[j].n, transpose);
-            if (min < 0 || min > dist) {
-                min     = dist;
-                closest = j;
+    for (t = 0; t < ntrials; t++) {
+        trials[t]    = select_weighted(random, npoints, mindist, eweight, clusterid, total);
+        potential[t] = 0;
+    }
+
+    #pragma omp parallel for private(i, t) schedule(static) if (partial)
+    for (b = 0; b < nblocks; b++) {
+        double *sum = partial ? partial + (size_t)b * ntrials : potential;
+        for (i = b * GREEDY_BLOCK; i < npoints && i < (b + 1) * GREEDY_BLOCK; i++) {
+            for (t = 0; t < ntrials; t++) {
+                double dist = metric(ndata, data, data, mask, mask, weight, i, trials[t], transpose);
+                if (dist > mindist[i]) dist = mindist[i];
+                sum[t] += (eweight ? eweight[i] : 1) * dist * dist;
             }
         }
+    }
+    if (partial) {
+        for (b = 0; b < nblocks; b++) {
+            for (t = 0; t < ntrials; t++)
+                potential[t] += partial[(size_t)b * ntrials + t];
+        }
+        free(partial);
+    }
 
-        dists[i].dist    = min * min;
-        dists[i].closest = closest;
-        total           += dists[i].dist;
+    for (t = 1; t < ntrials; t++) {
+        if (potential[t] < potential[best]) best = t;
     }
 
-    return total;
+    return trials[best];
 }
 
-void weightedassign(int nclusters, int nrows, int ncolumns,
-                    double** data, int** mask, double weight[], int transpose,
-                    double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int),
-                    int clusterid[]) {
+// k-means++, or greedy k-means++ when ntrials > 1. points count eweight[i] times unless eweight is NULL.
+int weightedassign(RandomState* random, int nclusters, int nrows, int ncolumns,
+                   double** data, int** mask, double weight[], int transpose, const double eweight[], int ntrials,
+                   double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int),
+                   int clusterid[]) {
 
-    int i, n, chosen = (int)((double)nrows*uniform());
+    int i, n;
     int ndata = (transpose == 0 ? ncolumns : nrows), npoints = (transpose == 0 ? nrows : ncolumns);
-    double total = 0, cutoff, curr;
-    clusterpoint dists[npoints];
+    int chosen = select_first(random, npoints, eweight);
+    double total;
+    double *mindist   = malloc(npoints * sizeof(double));
+    int *closest      = malloc(npoints * sizeof(int));
+    double *potential = NULL;
+    int *trials       = NULL;
+
+    if (ntrials > 1) {
+        potential = malloc(ntrials * sizeof(double));
+        trials    = malloc(ntrials * sizeof(int));
+    }
+
+    if (!mindist || !closest || (ntrials > 1 && (!potential || !trials))) {
+        free(mindist);
+        free(closest);
+        free(potential);
+        free(trials);
+        return 0;
+    }
 
     for (i = 0; i < npoints; i++) {
-        dists[i].n      = i;
-        dists[i].chosen = 0;
-        dists[i].dist   = 0;
+        clusterid[i] = -1;
+        closest[i]   = -1;
     }
 
     // setup 1st centroid
-    n                    = 1;
-    clusterid[chosen]    = 0;
-    dists[chosen].chosen = 1;
+    n                 = 1;
+    clusterid[chosen] = 0;
+    total             = update_distances(ndata, npoints, data, mask, weight, transpose, eweight, 1, &chosen, mindist, closest, metric);
 
     // pick k-points for k-clusters with a probability weighted by square of distance from closest centroid.
     while (n < nclusters) {
-        total = compute_distances(ndata, npoints, data, mask, weight, transpose, dists, metric);
-        qsort((void*)dists, npoints, sizeof(clusterpoint), compare);
+        if (ntrials > 1)
+            chosen = select_greedy(random, ntrials, ndata, npoints, data, mask, weight, transpose, eweight,
+                                   mindist, clusterid, total, trials, potential, metric);
+        else
+            chosen = select_weighted(random, npoints, mindist, eweight, clusterid, total);
+        clusterid[chosen] = n++;
+        total             = update_distances(ndata, npoints, data, mask, weight, transpose, eweight, 1, &chosen, mindist, closest, metric);
+    }
+
+    // assign remaining points to closest cluster
+    for (i = 0; i < npoints; i++) {
+        if (clusterid[i] < 0)
+            clusterid[i] = clusterid[closest[i]];
+    }
+
+    free(mindist);
+    free(closest);
+    free(potential);
+    free(trials);
+    return 1;
+}
+
+// reduce k-means|| candidates, weighted by the (weighted) number of points closest to them, to k centers with k-means++
+// and assign every point to the center closest to its candidate. clusterid holds each candidate's index on input.
+int reduce_candidates(RandomState* random, int nclusters, int ndata, int npoints,
+                      int ncandidates, const int candidates[],
+                      double** data, int** mask, double weight[], int transpose, const double eweight[],
+                      const int closest[],
+                      double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int),
+                      int clusterid[]) {
+
+    int i, c, n;
+    double total;
+    double *cweight  = malloc(ncandidates * sizeof(double));
+    double *cmindist = malloc(ncandidates * sizeof(double));
+    int *ccluster    = malloc(ncandidates * sizeof(int));
+    int *cclosest    = malloc(ncandidates * sizeof(int));
 
-        curr   = 0;
-        cutoff = total * uniform();
+    if (!cweight || !cmindist || !ccluster || !cclosest) {
+        free(cweight);
+        free(cmindist);
+        free(ccluster);
+        free(cclosest);
+        return 0;
+    }
+
+    for (c = 0; c < ncandidates; c++) {
+        cweight[c]  = 0;
+        cmindist[c] = 1;
+        ccluster[c] = -1;
+        cclosest[c] = -1;
+    }
+    total = 0;
+    for (i = 0; i < npoints; i++) {
+        cweight[clusterid[closest[i]]] += eweight ? eweight[i] : 1;
+        total                          += eweight ? eweight[i] : 1;
+    }
+
+    // weighted k-means++ over the candidates, the 1st center drawn by weight alone.
+    for (n = 0; n < nclusters; n++) {
+        int chosen = select_weighted(random, ncandidates, cmindist, cweight, ccluster, total);
+        ccluster[chosen] = n;
+        total = 0;
+        #pragma omp parallel for schedule(static)
+        for (c = 0; c < ncandidates; c++) {
+            double dist = metric(ndata, data, data, mask, mask, weight, candidates[c], candidates[chosen], transpose);
+            if (cclosest[c] < 0 || dist < cmindist[c]) {
+                cmindist[c] = dist;
+                cclosest[c] = chosen;
+            }
+        }
+        for (c = 0; c < ncandidates; c++)
+            total += cweight[c] * cmindist[c] * cmindist[c];
+    }
+
+    // points follow their closest candidate to its closest center, centers keep their own cluster.
+    for (i = 0; i < npoints; i++) {
+        if (clusterid[i] < 0)
+            clusterid[i] = ccluster[cclosest[clusterid[closest[i]]]];
+    }
+    for (c = 0; c < ncandidates; c++)
+        clusterid[candidates[c]] = ccluster[c] >= 0 ? ccluster[c] : ccluster[cclosest[c]];
+
+    free(cweight);
+    free(cmindist);
+    free(ccluster);
+    free(cclosest);
+    return 1;
+}
+
+// k-means|| (scalable k-means++): for a few rounds, every point is drawn independently with probability
+// proportional to the square of its distance from the closest candidate, about 2k candidates per round, and
+// distances are updated against each round's candidates in parallel. the candidates are then reduced to k
+// centers by reduce_candidates.
+int parallelassign(RandomState* random, int nclusters, int nrows, int ncolumns,
+                   double** data, int** mask, double weight[], int transpose, const double eweight[],
+                   double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int),
+                   int clusterid[]) {
+
+    int i, round, from, ok, ncandidates = 0;
+    int ndata = (transpose == 0 ? ncolumns : nrows), npoints = (transpose == 0 ? nrows : ncolumns);
+    int oversample = 2 * nclusters, rounds = 5;
+    double total;
+    double *mindist = malloc(npoints * sizeof(double));
+    int *closest    = malloc(npoints * sizeof(int));
+    int *candidates = malloc(npoints * sizeof(int));
+
+    if (!mindist || !closest || !candidates) {
+        free(mindist);
+        free(closest);
+        free(candidates);
+        return 0;
+    }
+
+    for (i = 0; i < npoints; i++) {
+        clusterid[i] = -1;
+        closest[i]   = -1;
+    }
+
+    // setup 1st candidate
+    i                       = select_first(random, npoints, eweight);
+    candidates[ncandidates] = i;
+    clusterid[i]            = ncandidates++;
+    total = update_distances(ndata, npoints, data, mask, weight, transpose, eweight, 1, &i, mindist, closest, metric);
+
+    // oversample candidates, stopping early once every point coincides with a candidate.
+    for (round = 0; round < rounds && total > 0; round++) {
+        from = ncandidates;
         for (i = 0; i < npoints; i++) {
-            if (dists[i].chosen) continue;
-            curr += dists[i].dist;
-            if (curr >= cutoff || i == (npoints - 1)) {
-                clusterid[dists[i].n] = n++;
-                dists[i].chosen       = 1;
-                dists[i].dist         = 0;
-                break;
+            if (clusterid[i] >= 0) continue;
+            if (uniform(random) * total < oversample * (eweight ? eweight[i] : 1) * mindist[i] * mindist[i]) {
+                candidates[ncandidates] = i;
+                clusterid[i]            = ncandidates++;
             }
         }
+        total = update_distances(ndata, npoints, data, mask, weight, transpose, eweight,
+                                 ncandidates - from, candidates + from, mindist, closest, metric);
     }
 
-    // assign remaining points to closest cluster
-    compute_distances(ndata, npoints, data, mask, weight, transpose, dists, metric);
-    for (n = 0; n < npoints; n++) {
-        if (dists[n].chosen) continue;
-        clusterid[dists[n].n] = clusterid[dists[dists[n].closest].n];
+    // top up with k-means++ draws in the unlikely case there are fewer candidates than clusters.
+    while (ncandidates < nclusters) {
+        i                       = select_weighted(random, npoints, mindist, eweight, clusterid, total);
+        candidates[ncandidates] = i;
+        clusterid[i]            = ncandidates++;
+        total = update_distances(ndata, npoints, data, mask, weight, transpose, eweight, 1, &i, mindist, closest, metric);
+    }
+
+    ok = reduce_candidates(random, nclusters, ndata, npoints, ncandidates, candidates, data, mask, weight, transpose,
+                           eweight, closest, metric, clusterid);
+
+    free(mindist);
+    free(closest);
+    free(candidates);
+    return ok;
+}
+
+// draw an index with probability proportional to its share of the cumulative weights, by binary search.
+int select_cumulative(RandomState* random, int npoints, const double cumulative[]) {
+    int lo = 0, hi = npoints - 1;
+    double cutoff = cumulative[npoints - 1] * uniform(random);
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cumulative[mid] < cutoff)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// square of the distance from a point to its closest center.
+double center_distance(int ndata, double **data, int **mask, double weight[], int transpose, int point,
+                       int ncenters, const int centers[],
+                       double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int)) {
+
+    int j;
+    double dist, min = -1;
+
+    for (j = 0; j < ncenters; j++) {
+        dist = metric(ndata, data, data, mask, mask, weight, point, centers[j], transpose);
+        if (min < 0 || dist < min)
+            min = dist;
     }
+
+    return min * min;
 }
 
-void spreadoutassign(int nclusters, int nrows, int ncolumns,
-                     double** data, int** mask, double weight[], int transpose,
-                     double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int),
-                     int clusterid[]) {
+// AFK-MC2 (assumption free k-MC2): each center after the first is the end of a Metropolis-Hastings chain of
+// chain_length points proposed from a fixed mix of the k-means++ distribution around the first center and the
+// uniform distribution, so only the proposals are compared with the centers. apart from one pass to build the
+// proposal, the cost is independent of the number of points. only the centers are labelled, the other points are
+// left at -1 for the first k-means iteration to assign.
+int afkmc2assign(RandomState* random, int nclusters, int nrows, int ncolumns,
+                 double** data, int** mask, double weight[], int transpose, const double eweight[], int chain_length,
+                 double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int),
+                 int clusterid[]) {
+
+    int i, j, n;
+    int ndata = (transpose == 0 ? ncolumns : nrows), npoints = (transpose == 0 ? nrows : ncolumns);
+    double total, wtotal = npoints;
+    double *mindist    = malloc(npoints * sizeof(double));
+    double *proposal   = malloc(npoints * sizeof(double));
+    int *closest       = malloc(npoints * sizeof(int));
+    int *centers       = malloc(nclusters * sizeof(int));
+
+    if (!mindist || !proposal || !closest || !centers) {
+        free(mindist);
+        free(proposal);
+        free(closest);
+        free(centers);
+        return 0;
+    }
+
+    if (chain_length < 1) chain_length = 200;
+
+    for (i = 0; i < npoints; i++) {
+        clusterid[i] = -1;
+        closest[i]   = -1;
+    }
+
+    // setup 1st centroid and the proposal q(x) = w d(x, c1)^2 / 2 sum w d^2 + w / 2 sum w, kept as a cumulative
+    // sum, where w is the weight of a point (1 if eweight is NULL).
+    centers[0]            = select_first(random, npoints, eweight);
+    clusterid[centers[0]] = 0;
+    total = update_distances(ndata, npoints, data, mask, weight, transpose, eweight, 1, centers, mindist, closest, metric);
+    if (eweight) {
+        wtotal = 0;
+        for (i = 0; i < npoints; i++)
+            wtotal += eweight[i];
+    }
+    for (i = 0; i < npoints; i++) {
+        double w = eweight ? eweight[i] : 1;
+        double q = (total > 0 ? 0.5 * w * mindist[i] * mindist[i] / total : 0) + (total > 0 ? 0.5 : 1.0) * w / wtotal;
+        proposal[i] = (i > 0 ? proposal[i - 1] : 0) + q;
+    }
+
+    for (n = 1; n < nclusters; n++) {
+        int x = select_cumulative(random, npoints, proposal);
+        double dx = center_distance(ndata, data, mask, weight, transpose, x, n, centers, metric);
+        double qx = proposal[x] - (x > 0 ? proposal[x - 1] : 0);
+
+        if (eweight) dx *= eweight[x];
+
+        // accept y over x with probability min(1, w(y) d(y)^2 q(x) / w(x) d(x)^2 q(y)).
+        for (j = 1; j < chain_length; j++) {
+            int y = select_cumulative(random, npoints, proposal);
+            double dy = center_distance(ndata, data, mask, weight, transpose, y, n, centers, metric);
+            double qy = proposal[y] - (y > 0 ? proposal[y - 1] : 0);
+            if (eweight) dy *= eweight[y];
+            if (dx * qy == 0 ? dy > 0 : dy * qx > dx * qy * uniform(random)) {
+                x  = y;
+                dx = dy;
+                qx = qy;
+            }
+        }
+
+        // every proposal coincided with a center, take the next point not chosen yet.
+        for (i = 0; clusterid[x] >= 0 && i < npoints; i++)
+            x = (x + 1) % npoints;
+
+        centers[n]    = x;
+        clusterid[x]  = n;
+    }
+
+    free(mindist);
+    free(proposal);
+    free(closest);
+    free(centers);
+    return 1;
+}
+
+// returns 2 if the square root of the metric satisfies the triangle inequality on this data, 1 if the metric
+// itself does and 0 otherwise. euclid and cityblock normalize by the weights of the values present in both
+// points, which is only a fixed scale when no values are missing.
+int triangle_metric(int ndata, int npoints, int** mask, double weight[], int transpose,
+                    double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int)) {
+
+    int i, j;
+
+    if (metric != euclid && metric != cityblock) return 0;
+    for (j = 0; j < ndata; j++) {
+        if (weight[j] < 0) return 0;
+    }
+    for (i = 0; i < npoints; i++) {
+        for (j = 0; j < ndata; j++) {
+            if (!(transpose == 0 ? mask[i][j] : mask[j][i])) return 0;
+        }
+    }
+
+    return metric == euclid ? 2 : 1;
+}
+
+// farthest-point traversal (Gonzalez): each new center is the point farthest from its closest center. points
+// keep their distance to the closest center, so each round costs one pass over the points against the newest
+// center. when the metric satisfies the triangle inequality, points whose closest center is at least twice
+// their distance away from the newest center cannot get closer to it and are skipped.
+int spreadoutassign(RandomState* random, int nclusters, int nrows, int ncolumns,
+                    double** data, int** mask, double weight[], int transpose,
+                    double (*metric)(int, double**, double**, int**, int**, const double[], int, int, int),
+                    int clusterid[]) {
 
     int i, n, chosen = 0;
     int ndata = (transpose == 0 ? ncolumns : nrows), npoints = (transpose == 0 ? nrows : ncolumns);
-    clusterpoint dists[npoints];
+    int triangle = triangle_metric(ndata, npoints, mask, weight, transpose, metric);
+    double *mindist = malloc(npoints * sizeof(double));
+    double *cdist   = malloc(nclusters * sizeof(double));
+    int *closest    = malloc(npoints * sizeof(int));
+    int *centers    = malloc(nclusters * sizeof(int));
+
+    if (!mindist || !cdist || !closest || !centers) {
+        free(mindist);
+        free(cdist);
+        free(closest);
+        free(centers);
+        return 0;
+    }
 
     for (i = 0; i < npoints; i++) {
-        dists[i].n      = i;
-        dists[i].chosen = 0;
-        dists[i].dist   = 0;
+        clusterid[i] = -1;
+        closest[i]   = 0;
     }
 
     // setup 1st centroid
-    n                    = 1;
-    clusterid[chosen]    = 0;
-    dists[chosen].chosen = 1;
+    n                 = 1;
+    centers[0]        = chosen;
+    clusterid[chosen] = 0;
+
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < npoints; i++)
+        mindist[i] = metric(ndata, data, data, mask, mask, weight, i, chosen, transpose);
 
     // pick k-points for k-clusters with max distance from all centers.
-    chosen = npoints - 1;
     while (n < nclusters) {
-        compute_distances(ndata, npoints, data, mask, weight, transpose, dists, metric);
-        qsort((void*)dists, npoints, sizeof(clusterpoint), compare);
+        chosen = -1;
+
+        #pragma omp parallel
+        {
+            int best = -1;
+
+            #pragma omp for schedule(static) nowait
+            for (i = 0; i < npoints; i++) {
+                if (clusterid[i] < 0 && (best < 0 || mindist[i] > mindist[best]))
+                    best = i;
+            }
+
+            // ties go to the lowest index, as in a sequential scan.
+            #pragma omp critical
+            {
+                if (best >= 0 && (chosen < 0 || mindist[best] > mindist[chosen] ||
+                                  (mindist[best] == mindist[chosen] && best < chosen)))
+                    chosen = best;
+            }
+        }
+
+        centers[n]        = chosen;
+        clusterid[chosen] = n;
+
+        if (triangle) {
+            int j;
+            for (j = 0; j < n; j++) {
+                cdist[j] = metric(ndata, data, data, mask, mask, weight, chosen, centers[j], transpose);
+                if (triangle == 2) cdist[j] = sqrt(cdist[j]);
+            }
+        }
+
+        #pragma omp parallel for schedule(static)
+        for (i = 0; i < npoints; i++) {
+            double dist;
+            if (clusterid[i] >= 0) continue;
+            if (triangle && cdist[closest[i]] >= 2 * (triangle == 2 ? sqrt(mindist[i]) : mindist[i])) continue;
 
-        clusterid[dists[chosen].n] = n++;
-        dists[chosen].chosen       = 1;
-        dists[chosen].dist         = 0;
+            dist = metric(ndata, data, data, mask, mask, weight, i, chosen, transpose);
+            if (dist < mindist[i]) {
+                mindist[i] = dist;
+                closest[i] = n;
+            }
+        }
+        n++;
     }
 
     // assign remaining points to closest cluster
-    compute_distances(ndata, npoints, data, mask, weight, transpose, dists, metric);
-    for (n = 0; n < npoints; n++) {
-        if (dists[n].chosen) continue;
-        clusterid[dists[n].n] = clusterid[dists[dists[n].closest].n];
+    for (i = 0; i < npoints; i++) {
+        if (clusterid[i] < 0)
+            clusterid[i] = closest[i];
+    }
+
+    free(mindist);
+    free(cdist);
+    free(closest);
+    free(centers);
+    return 1;
+}
+
+// value j of point i, divided by scale[i] if scale is not NULL. returns 0 if the value is missing.
+static int member_value(double **data, int **mask, int transpose, const double scale[], int i, int j,
+                        double *value) {
+    if (!(transpose == 0 ? mask[i][j] : mask[j][i])) return 0;
+    *value = (transpose == 0 ? data[i][j] : data[j][i]) / (scale ? scale[i] : 1);
+    return 1;
+}
+
+// mean of the members (all points if members is NULL) in mean[], each counted eweight[i] times and divided by
+// scale[i] if those are not NULL. returns the sum of the squared deviations from the mean, with dimensions
+// weighted by weight[] if not NULL and missing values counted as the mean.
+double member_scatter(int ndata, int nmembers, const int members[], double **data, int **mask,
+                      const double weight[], int transpose, const double eweight[], const double scale[],
+                      double mean[]) {
+
+    int j, m;
+    double total = 0;
+
+    // the scatter of each dimension is added in order, so that the sum does not depend on the number of threads.
+    #pragma omp parallel for private(m) schedule(static, 1) ordered
+    for (j = 0; j < ndata; j++) {
+        double sum = 0, count = 0, scatter = 0, value;
+        for (m = 0; m < nmembers; m++) {
+            int i = members ? members[m] : m;
+            if (member_value(data, mask, transpose, scale, i, j, &value)) {
+                sum   += (eweight ? eweight[i] : 1) * value;
+                count += (eweight ? eweight[i] : 1);
+            }
+        }
+        mean[j] = count > 0 ? sum / count : 0;
+        for (m = 0; m < nmembers; m++) {
+            int i = members ? members[m] : m;
+            if (member_value(data, mask, transpose, scale, i, j, &value))
+                scatter += (eweight ? eweight[i] : 1) * (value - mean[j]) * (value - mean[j]);
+        }
+        #pragma omp ordered
+        total += (weight ? weight[j] : 1) * scatter;
+    }
+
+    return total;
+}
+
+// product of the weighted scatter matrix of the members with x, in y[], without building the matrix: each member's
+// deviation from the mean, in the space where dimension j is scaled by sqrt(weight[j]), is projected on x and
+// added back along itself. projection[] holds one value per member. returns x . y.
+static double scatter_product(int ndata, int nmembers, const int members[], double **data, int **mask,
+                              const double weight[], int transpose, const double eweight[], const double scale[],
+                              const double mean[], const double x[], double y[], double projection[]) {
+
+    int j, m;
+    double value, product = 0;
+
+    #pragma omp parallel for private(j, value) schedule(static)
+    for (m = 0; m < nmembers; m++) {
+        int i = members ? members[m] : m;
+        double sum = 0;
+        for (j = 0; j < ndata; j++) {
+            if (member_value(data, mask, transpose, scale, i, j, &value))
+                sum += sqrt(weight ? weight[j] : 1) * (value - mean[j]) * x[j];
+        }
+        projection[m] = (eweight ? eweight[i] : 1) * sum;
+    }
+
+    #pragma omp parallel for private(m, value) schedule(static, 1) ordered
+    for (j = 0; j < ndata; j++) {
+        double sum = 0;
+        for (m = 0; m < nmembers; m++) {
+            if (member_value(data, mask, transpose, scale, members ? members[m] : m, j, &value))
+                sum += projection[m] * (value - mean[j]);
+        }
+        y[j] = sqrt(weight ? weight[j] : 1) * sum;
+        #pragma omp ordered
+        product += x[j] * y[j];
+    }
+
+    return product;
+}
+
+// remove the components of x along the first naxes axes and scale it to unit length. returns its length before.
+static double orthonormalize(int ndata, int naxes, double **axes, double x[]) {
+    int a, j;
+    double dot, norm = 0;
+
+    for (a = 0; a < naxes; a++) {
+        dot = 0;
+        for (j = 0; j < ndata; j++)
+            dot += x[j] * axes[a][j];
+        for (j = 0; j < ndata; j++)
+            x[j] -= dot * axes[a][j];
+    }
+    for (j = 0; j < ndata; j++)
+        norm += x[j] * x[j];
+    norm = sqrt(norm);
+    for (j = 0; norm > 0 && j < ndata; j++)
+        x[j] /= norm;
+
+    return norm;
+}
+
+// the naxes principal axes of the members, as in member_scatter, by power iteration on their scatter matrix, each
+// axis kept orthogonal to the ones before. the axes are unit vectors in axes[naxes][ndata], largest variance
+// first, in the space where dimension j is scaled by sqrt(weight[j]), with the variance along each in variance[].
+// each iteration costs two passes over the members, and the iterations stop once the variance changes by less
+// than one part in 1e6. returns 0 if out of memory.
+int principal_axes(int ndata, int nmembers, const int members[], double **data, int **mask,
+                   const double weight[], int transpose, const double eweight[], const double scale[],
+                   int naxes, double mean[], double **axes, double variance[]) {
+
+    int i, j, m, a, far;
+    double wtotal = 0, lambda, previous, norm, farthest;
+    double *y          = malloc(ndata * sizeof(double));
+    double *projection = malloc((nmembers > 0 ? nmembers : 1) * sizeof(double));
+
+    if (!y || !projection) {
+        free(y);
+        free(projection);
+        return 0;
+    }
+
+    member_scatter(ndata, nmembers, members, data, mask, weight, transpose, eweight, scale, mean);
+    for (m = 0; m < nmembers; m++)
+        wtotal += eweight ? eweight[members ? members[m] : m] : 1;
+
+    // start from the deviation of the member farthest from the mean, which is rarely orthogonal to the axis.
+    far = 0;
+    farthest = -1;
+    for (m = 0; m < nmembers; m++) {
+        double sum = 0, value;
+        for (j = 0; j < ndata; j++) {
+            if (member_value(data, mask, transpose, scale, members ? members[m] : m, j, &value))
+                sum += (weight ? weight[j] : 1) * (value - mean[j]) * (value - mean[j]);
+        }
+        if (sum > farthest) {
+            farthest = sum;
+            far      = m;
+        }
+    }
+
+    for (a = 0; a < naxes; a++) {
+        double *x = axes[a];
+        variance[a] = 0;
+        for (j = 0; j < ndata; j++) {
+            double value;
+            x[j] = nmembers > 0 && member_value(data, mask, transpose, scale, members ? members[far] : far, j, &value)
+                 ? sqrt(weight ? weight[j] : 1) * (value - mean[j]) : 0;
+        }
+        // if that start has no component left, try the dimensions in turn.
+        norm = orthonormalize(ndata, a, axes, x);
+        for (i = 0; norm <= 0 && i < ndata; i++) {
+            for (j = 0; j < ndata; j++)
+                x[j] = (i == j);
+            norm = orthonormalize(ndata, a, axes, x);
+        }
+        if (norm <= 0) continue;
+
+        lambda = scatter_product(ndata, nmembers, members, data, mask, weight, transpose, eweight, scale, mean, x,
+                                 y, projection);
+        for (i = 0; i < 100; i++) {
+            // a null product means x already spans the rest of the variance, which is zero.
+            if (orthonormalize(ndata, a, axes, y) <= 0) break;
+            for (j = 0; j < ndata; j++)
+                x[j] = y[j];
+            previous = lambda;
+            lambda   = scatter_product(ndata, nmembers, members, data, mask, weight, transpose, eweight, scale, mean,
+                                       x, y, projection);
+            if (fabs(lambda - previous) <= 1e-6 * fabs(lambda)) break;
+        }
+        variance[a] = wtotal > 0 && lambda > 0 ? lambda / wtotal : 0;
+    }
+
+    free(y);
+    free(projection);
+    return 1;
+}
+
+// pca-part (Su and Dy): starting from a single cluster, split the cluster with the largest sum of squared
+// deviations by a hyperplane orthogonal to its principal axis, until there are nclusters. rather than through
+// the mean, the hyperplane is placed where the projections on the axis split best into two groups, which keeps
+// well separated clusters whole. deterministic, returns 0 if out of memory.
+int pcaassign(int nclusters, int nrows, int ncolumns, double** data, int** mask, double weight[], int transpose,
+              const double eweight[], int clusterid[]) {
+
+    int i, j, c, best, nmembers, nsplit;
+    int ndata = (transpose == 0 ? ncolumns : nrows), npoints = (transpose == 0 ? nrows : ncolumns);
+    double variance, value, mincost = 0;
+    double *wsum       = calloc(npoints + 1, sizeof(double));
+    double *psum       = calloc(npoints + 1, sizeof(double));
+    double *sqsum      = calloc(npoints + 1, sizeof(double));
+    double *scatter    = malloc(nclusters * sizeof(double));
+    double *mean       = malloc(ndata * sizeof(double));
+    double *axis       = malloc(ndata * sizeof(double));
+    double *projection = malloc(npoints * sizeof(double));
+    int *counts        = malloc(nclusters * sizeof(int));
+    int *members       = malloc(npoints * sizeof(int));
+    int *index         = malloc(npoints * sizeof(int));
+
+    if (!wsum || !psum || !sqsum || !scatter || !mean || !axis || !projection || !counts || !members || !index) {
+        free(wsum);
+        free(psum);
+        free(sqsum);
+        free(scatter);
+        free(mean);
+        free(axis);
+        free(projection);
+        free(counts);
+        free(members);
+        free(index);
+        return 0;
     }
+
+    for (i = 0; i < npoints; i++)
+        clusterid[i] = 0;
+    counts[0]  = npoints;
+    scatter[0] = member_scatter(ndata, npoints, NULL, data, mask, weight, transpose, eweight, NULL, mean);
+
+    for (c = 1; c < nclusters; c++) {
+        best = -1;
+        for (j = 0; j < c; j++) {
+            if (counts[j] >= 2 && (best < 0 || scatter[j] > scatter[best])) best = j;
+        }
+
+        nmembers = 0;
+        for (i = 0; i < npoints; i++) {
+            if (clusterid[i] == best) members[nmembers++] = i;
+        }
+        if (!principal_axes(ndata, nmembers, members, data, mask, weight, transpose, eweight, NULL, 1, mean,
+                            &axis, &variance)) {
+            free(wsum);
+            free(psum);
+            free(sqsum);
+            free(scatter);
+            free(mean);
+            free(axis);
+            free(projection);
+            free(counts);
+            free(members);
+            free(index);
+            return 0;
+        }
+
+        #pragma omp parallel for private(j, value) schedule(static)
+        for (i = 0; i < nmembers; i++) {
+            double sum = 0;
+            for (j = 0; j < ndata; j++) {
+                if (member_value(data, mask, transpose, NULL, members[i], j, &value))
+                    sum += sqrt(weight[j]) * (value - mean[j]) * axis[j];
+            }
+            projection[i] = sum;
+        }
+
+        // cut the sorted projections where the two sides have the smallest sum of squared deviations.
+        sort(nmembers, projection, index);
+        for (i = 0; i < nmembers; i++) {
+            double we = eweight ? eweight[members[index[i]]] : 1;
+            wsum[i + 1]  = wsum[i] + we;
+            psum[i + 1]  = psum[i] + we * projection[index[i]];
+            sqsum[i + 1] = sqsum[i] + we * projection[index[i]] * projection[index[i]];
+        }
+        nsplit = nmembers / 2;
+        for (i = 1; i < nmembers; i++) {
+            double lw = wsum[i], rw = wsum[nmembers] - wsum[i];
+            double ls = psum[i], rs = psum[nmembers] - psum[i];
+            double cost = sqsum[nmembers] - (lw > 0 ? ls * ls / lw : 0) - (rw > 0 ? rs * rs / rw : 0);
+            if (i == 1 || cost < mincost) {
+                mincost = cost;
+                nsplit  = i;
+            }
+        }
+
+        for (i = nsplit; i < nmembers; i++)
+            clusterid[members[index[i]]] = c;
+        counts[best] = nsplit;
+        counts[c]    = nmembers - nsplit;
+
+        // members are in increasing order, so each side keeps them sorted.
+        for (j = 0, i = 0; i < nmembers; i++) {
+            if (clusterid[members[i]] == best) members[j++] = members[i];
+        }
+        scatter[best] = member_scatter(ndata, counts[best], members, data, mask, weight, transpose, eweight, NULL,
+                                       mean);
+        for (j = 0, i = 0; i < npoints; i++) {
+            if (clusterid[i] == c) members[j++] = i;
+        }
+        scatter[c] = member_scatter(ndata, counts[c], members, data, mask, weight, transpose, eweight, NULL, mean);
+    }
+
+    free(wsum);
+    free(psum);
+    free(sqsum);
+    free(scatter);
+    free(mean);
+    free(axis);
+    free(projection);
+    free(counts);
+    free(members);
+    free(index);
+    return 1;
 }
@@ -94,12 +94,59 @@ module Flock
   #                                             - Flock::SEED_RANDOM (default)
   #                                             - Flock::SEED_KMEANS_PLUSPLUS
   #                                             - Flock::SEED_SPREADOUT
+  #                                             - Flock::SEED_KMEANS_PARALLEL
+  #                                             - Flock::SEED_AFKMC2
+  #                                             - Flock::SEED_PCA
+  # @option options [Numeric]     :tolerance      Stop a pass once an iteration improves the error by less than this
+  #                                               fraction (defaults to: 0, run until the error stops decreasing).
+  # @option options [Numeric]     :moved_fraction Stop a pass once fewer than this fraction of data points change
+  #                                               cluster in an iteration (defaults to: 0).
+  # @option options [Fixnum]      :max_iterations Maximum number of iterations in each pass (defaults to: 0, no limit).
+  # @option options [Fixnum]      :stop_after_repeats Stop once the best solution has been found this many times
+  #                                               (defaults to: 0, run all iterations).
+  # @option options [Numeric]     :time_budget    Return the best solution found so far after this many seconds; the
+  #                                               first pass is always completed (defaults to: 0, no limit).
+  # @option options [true, false] :abort_passes   Abandon a pass once its error improvements shrink while it is still
+  #                                               more than 30 such improvements above the best error so far. This
+  #                                               is a heuristic: a pass that keeps improving slowly may have beaten
+  #                                               the best one, so the optimum can be missed. Without it, every pass
+  #                                               runs to convergence (defaults to: false).
+  # @option options [Fixnum]      :median_sample  With Flock::METHOD_MEDIAN, approximate the median of clusters larger
+  #                                               than this from as many members drawn with :random_seed (by
+  #                                               weight with :sample_weights). With probability 1 - d, each
+  #                                               median coordinate then lies between the 1/2 - e and 1/2 + e
+  #                                               quantiles of the cluster, e = sqrt(ln(2/d) / (2 * median_sample)):
+  #                                               the 46th to 54th percentile 95% of the time for 1000 (defaults
+  #                                               to: 0, exact).
+  # @option options [Fixnum]      :candidates     With Flock::SEED_KMEANS_PLUSPLUS, draw this many candidates for each
+  #                                               initial center and keep the one that most reduces the error
+  #                                               (greedy k-means++, defaults to: 1).
+  # @option options [Fixnum]      :chain_length   With Flock::SEED_AFKMC2, the Markov chain length used to pick each
+  #                                               initial center (defaults to: 200).
+  # @option options [Fixnum]      :coreset        With Flock::METHOD_AVERAGE, cluster a weighted sample of this many
+  #                                               draws and assign all data points to the resulting centers
+  #                                               (defaults to: 0, cluster all data points).
+  # @option options [Integer]     :random_seed    Seed for the random number generator, so that the same seed, 0
+  #                                               included, reproduces the same result (defaults to: nil, seeded from
+  #                                               the clock).
+  # @option options [Boolean]     :early_abandon  Abandon Euclidean and city-block distances to centroids once they
+  #                                               exceed the nearest found so far (defaults to: nil, only with 512 or
+  #                                               more dimensions). Results are unchanged.
+  # @option options [Array]       :sample_weights Numeric weight for each data point, counted as that many copies of
+  #                                               it in the centroids, the error and the seeding (defaults to: all 1).
+  # @option options [true, false] :dedup          Cluster only the unique data points (with their mask), weighted by
+  #                                               their multiplicity, and expand the labels back to every data point.
+  #                                               With fewer unique data points than clusters, all data points are
+  #                                               clustered as if dedup were false (defaults to: false).
   # @return [Hash]
   #   {
-  #     :cluster  => [Array],
-  #     :centroid => [Array<Array>],
-  #     :error    => [Numeric],
-  #     :repeated => [Fixnum]
+  #     :cluster         => [Array],
+  #     :centroid        => [Array<Array>],
+  #     :error           => [Numeric],
+  #     :repeated        => [Fixnum],
+  #     :pass_iterations => [Array<Fixnum>],  # iterations used by each pass
+  #     :error_trace     => [Array<Array>],   # error after each iteration of each pass
+  #     :skipped_terms   => [Fixnum]          # dimension terms skipped by :early_abandon
   #   }
   def self.kcluster size, data, options = {}
     options[:sparse] = true if sparse?(data[0])
@@ -107,7 +154,7 @@ module Flock
       data, options[:weights] = densify(data, options[:weights])
       options[:mask]          = nil
     end
-    do_kcluster(size, data, options)
+    options[:dedup] ? dedup_kcluster(size, data, options) : do_kcluster(size, data, options)
   end
 
   # Arranges data points on a 2D grid without having to specify a fixed cluster size. So in theory you could have
@@ -131,6 +178,10 @@ module Flock
   # @option options   [Fixnum]      :iterations See Flock#kcluster
   # @option options   [Fixnum]      :metric     See Flock#kcluster
   # @option options   [Numeric]     :tau        Initial tau value for distance metric.
+  # @option options   [Fixnum]      :seed       Flock::SEED_PCA spreads the initial nodes over the first two
+  #                                             principal axes of the data, any other value initializes them
+  #                                             randomly (defaults to: Flock::SEED_RANDOM).
+  # @option options   [Integer]     :random_seed See Flock#kcluster
   # @return [Hash]
   #   {
   #     :cluster  => [Array<Array>],
@@ -158,7 +209,10 @@ module Flock
   #   result = Flock.treecluster(2, data, sparse: true)
   #
   # @param  [Fixnum]  size        Number of clusters required. (See Flock#kcluster)
-  # @param  [Array]   data        See Flock#kcluster
+  # @param  [Array, Flock::DistanceMatrix] data See Flock#kcluster, or precomputed distances for any method but
+  #                                             centroid linkage, in which case the other options are ignored.
+  #                                             Ward linkage needs a matrix computed (or loaded) with
+  #                                             metric: Flock::METRIC_EUCLIDIAN, and raises ArgumentError otherwise.
   # @option options   [Array]       :mask       See Flock#kcluster
   # @option options   [true, false] :transpose  See Flock#kcluster
   # @option options   [Fixnum]      :iterations See Flock#kcluster
@@ -168,11 +222,39 @@ module Flock
   #                                               - Flock::METHOD_MAXIMUM_LINKAGE
   #                                               - Flock::METHOD_AVERAGE_LINKAGE (default)
   #                                               - Flock::METHOD_CENTROID_LINKAGE
+  #                                               - Flock::METHOD_WARD_LINKAGE (meant for
+  #                                                 Flock::METRIC_EUCLIDIAN)
+  # @option options   [true, false] :float_distances Store the pairwise distances as
+  #                                               single precision floats, halving the
+  #                                               memory of the distance matrix.
+  # @option options   [true, String] :on_disk     Keep the distance matrix in a memory-mapped
+  #                                               temporary file, in the given directory or
+  #                                               the system default with true. Raises IOError
+  #                                               if the file cannot be created. The file holds
+  #                                               the matrix in 32 x 32 tiles, so that the rows
+  #                                               and columns the linkage methods read each take
+  #                                               one page per 32 distances.
+  # @option options   [true, false] :flat       Only return the clusters, without :tree, skipping the merges above
+  #                                               the cut where the method allows (defaults to: false).
+  # @option options   [true, false] :nn_chain   Use the nearest-neighbor chain for maximum, average and Ward
+  #                                               linkage, O(n^2) in all cases but merges at equal distances may
+  #                                               come in a different order than the default closest pair search,
+  #                                               changing cuts on data with ties (defaults to: false).
+  # @option options   [Fixnum]      :micro_clusters Two-stage clustering for large data: compress the data points
+  #                                               into this many k-means micro-clusters (at least size), then
+  #                                               cluster their centroids, weighted by their sizes. Needs memory
+  #                                               for micro_clusters squared distances instead of data size
+  #                                               squared. The k-means pass takes :seed, :random_seed and the
+  #                                               convergence options (:max_iterations, :tolerance, :coreset...)
+  #                                               as in Flock#kcluster.
   # @return [Hash]
   #   {
-  #     :cluster => [Array]
+  #     :cluster       => [Array],
+  #     :tree          => [Flock::Tree], # all merges, to cut at other sizes or distances without clustering again
+  #     :micro_cluster => [Array]        # with :micro_clusters, the leaf of :tree of each data point
   #   }
   def self.treecluster size, data, options = {}
+    return do_matrix_treecluster(size, data, options) if data.kind_of?(DistanceMatrix)
     options[:sparse] = true if sparse?(data[0])
     if options[:sparse]
       data, options[:weights] = densify(data, options[:weights])
@@ -181,6 +263,50 @@ module Flock
     do_treecluster(size, data, options)
   end
 
+  # Groups data points around medoids, the data points with the smallest sum of distances to the other members of
+  # their cluster, using only the distances between them.
+  #
+  # @example
+  #
+  #   matrix = Flock::DistanceMatrix.new(data, metric: Flock::METRIC_CITY_BLOCK)
+  #   result = Flock.kmedoids(3, matrix, random_seed: 42)
+  #
+  # @param  [Fixnum]                size     Number of clusters required.
+  # @param  [Flock::DistanceMatrix] matrix   Distances between the data points.
+  # @option options [Fixnum]  :iterations    Number of passes, each from a random assignment (defaults to: 100).
+  # @option options [Integer] :random_seed   See Flock#kcluster
+  # @return [Hash]
+  #   {
+  #     :cluster  => [Array],         # cluster of each data point, numbered in order of appearance
+  #     :medoid   => [Array<Fixnum>], # data point at the center of each cluster
+  #     :error    => [Numeric],       # sum of the distances of the data points to their medoids
+  #     :repeated => [Fixnum]
+  #   }
+  def self.kmedoids size, matrix, options = {}
+    do_kmedoids(size, matrix, options)
+  end
+
+  # Scores how well each data point fits its cluster, (b - a) / max(a, b) where a is the average distance to the
+  # other members of its cluster and b the smallest average distance to the members of another cluster. Scores
+  # range from -1 to 1; data points alone in their cluster score 0.
+  #
+  # @example
+  #
+  #   matrix = Flock::DistanceMatrix.new(data)
+  #   Flock.silhouette(matrix, Flock.treecluster(4, matrix)[:cluster])[:score]
+  #
+  # @param  [Flock::DistanceMatrix] matrix   Distances between the data points.
+  # @param  [Array]                 cluster  Cluster of each data point, any values.
+  # @return [Hash]
+  #   {
+  #     :score  => [Numeric], # average over the data points
+  #     :values => [Array]    # score of each data point
+  #   }
+  def self.silhouette matrix, cluster
+    ids = {}
+    do_silhouette(matrix, cluster.map {|id| ids[id] ||= ids.size}, ids.size)
+  end
+
   # @deprecated use {kcluster} instead.
   def self.kmeans size, data, options = {}
     kcluster(size, data, options)
@@ -233,6 +359,33 @@ module Flock
       [dims, data]
     end
 
+    # Clusters the unique data points (rows, or columns with :transpose) with their multiplicities as sample
+    # weights, then maps the cluster of each unique data point back to all of its copies. Without enough unique data
+    # points for size clusters, the copies are kept apart and all data points are clustered.
+    def self.dedup_kcluster size, data, options
+      points  = options[:transpose] ? data.transpose : data
+      masks   = options[:mask] && (options[:transpose] ? options[:mask].transpose : options[:mask])
+      weights = options[:sample_weights]
+      index   = {}
+      unique  = []
+      counts  = []
+      labels  = points.each_with_index.map do |point, i|
+        key = masks ? [point, masks[i]] : point
+        j   = index[key] ||= (unique << i; counts << 0; unique.size - 1)
+        counts[j] += weights ? weights[i] : 1
+        j
+      end
+      return do_kcluster(size, data, options) if unique.size < size
+
+      data = unique.map {|i| points[i]}
+      mask = masks && unique.map {|i| masks[i]}
+      data, mask = data.transpose, mask && mask.transpose if options[:transpose]
+
+      result = do_kcluster(size, data, options.merge(mask: mask, sample_weights: counts))
+      result[:cluster] = labels.map {|j| result[:cluster][j]}
+      result
+    end
+
     def self.densify sparse_data, weights = nil
       dims, data = sparse_array?(sparse_data[0]) ? sparse_array_to_data(sparse_data) : sparse_hash_to_data(sparse_data)
 
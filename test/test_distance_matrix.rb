@@ -0,0 +1,86 @@
+require 'minitest/autorun'
+require_relative '../lib/flock'
+
+# Checks the condensed lower triangle of Flock::DistanceMatrix, in double and float precision, and the k-medoids and
+# silhouette results on it, against the distances computed from the raw data.
+class TestDistanceMatrix < Minitest::Test
+  def data
+    srand(15)
+    Array.new(50) { Array.new(4) { rand } }
+  end
+
+  def test_condensed_lower_triangle
+    rows     = data
+    expected = (1...rows.size).flat_map {|i| (0...i).map {|j| Flock.euclidian_distance(rows[i], rows[j])}}
+    matrix   = Flock::DistanceMatrix.new(rows)
+    assert_equal expected, matrix.dump.unpack('D*')
+    assert_equal rows.size, matrix.size
+    refute matrix.float?
+    full = rows.each_index.map {|i| rows.each_index.map {|j| i == j ? 0 : Flock.euclidian_distance(rows[i], rows[j])}}
+    assert_equal full, rows.each_index.map {|i| rows.each_index.map {|j| matrix[i, j]}}
+  end
+
+  def test_float_distances_round_to_single_precision
+    rows     = data
+    expected = (1...rows.size).flat_map {|i| (0...i).map {|j| Flock.euclidian_distance(rows[i], rows[j])}}
+    matrix   = Flock::DistanceMatrix.new(rows, float_distances: true)
+    assert matrix.float?
+    assert_equal expected.pack('F*').unpack('F*'), matrix.dump.unpack('F*')
+    assert_equal expected.pack('F*').unpack('F*')[3], matrix[3, 0]
+  end
+
+  def test_dump_and_load_round_trip
+    [false, true].each do |float|
+      matrix = Flock::DistanceMatrix.new(data, float_distances: float)
+      format = float ? 'F*' : 'D*'
+      [matrix.dump, matrix.dump.unpack(format)].each do |distances|
+        loaded = Flock::DistanceMatrix.load(distances, float_distances: float)
+        assert_equal matrix.dump, loaded.dump
+        assert_equal matrix.size, loaded.size
+        assert_equal float, loaded.float?
+        assert_equal matrix[17, 42], loaded[42, 17]
+      end
+    end
+    assert_raises(ArgumentError) { Flock::DistanceMatrix.load([1.0, 2.0]) }
+  end
+
+  def test_kmedoids_matches_raw_data
+    rows     = data
+    distance = ->(i, j) { i == j ? 0 : Flock.euclidian_distance(rows[i], rows[j]) }
+    matrix   = Flock::DistanceMatrix.new(rows)
+    result   = Flock.kmedoids(4, matrix, random_seed: 3)
+    clusters = rows.each_index.group_by {|i| result[:cluster][i]}
+
+    result[:medoid].each_with_index do |medoid, c|
+      members = clusters[c]
+      assert_includes members, medoid
+      best = members.map {|m| members.sum {|i| distance[i, m]}}.min
+      assert_in_delta best, members.sum {|i| distance[i, medoid]}, 1e-12, "medoid of cluster #{c}"
+    end
+    rows.each_index do |i|
+      nearest = result[:medoid].map {|m| distance[i, m]}.min
+      assert_equal nearest, distance[i, result[:medoid][result[:cluster][i]]], "data point #{i}"
+    end
+    assert_in_delta rows.each_index.sum {|i| distance[i, result[:medoid][result[:cluster][i]]]}, result[:error], 1e-12
+    assert_equal result, Flock.kmedoids(4, Flock::DistanceMatrix.load(matrix.dump), random_seed: 3)
+  end
+
+  def test_silhouette_matches_raw_data
+    rows     = data
+    distance = ->(i, j) { Flock.euclidian_distance(rows[i], rows[j]) }
+    cluster  = rows.each_index.map {|i| %w(a b c)[i % 7 % 3]}
+    expected = rows.each_index.map do |i|
+      mean = lambda do |c|
+        others = rows.each_index.select {|j| j != i && cluster[j] == c}
+        others.sum {|j| distance[i, j]} / others.size
+      end
+      a    = mean[cluster[i]]
+      b    = (%w(a b c) - [cluster[i]]).map {|c| mean[c]}.min
+      (b - a) / [a, b].max
+    end
+
+    result = Flock.silhouette(Flock::DistanceMatrix.new(rows), cluster)
+    expected.zip(result[:values]).each_with_index {|(e, v), i| assert_in_delta e, v, 1e-12, "data point #{i}"}
+    assert_in_delta expected.sum / rows.size, result[:score], 1e-12
+  end
+end
@@ -0,0 +1,114 @@
+require 'minitest/autorun'
+require_relative '../lib/flock'
+
+# Checks that the kcluster speedups leave results unchanged, and the pass control through the error trace of each pass.
+class TestKcluster < Minitest::Test
+  def uniform_data
+    srand(4)
+    Array.new(2000) { [rand, rand] }
+  end
+
+  # a pass runs to convergence when its error stopped decreasing or came back to an earlier value (a cycle).
+  def converged? errors
+    errors.size < 2 || errors[-1] >= errors[-2] || errors[0..-2].include?(errors[-1])
+  end
+
+  # integer values in many dimensions, so that distances tie often and early abandoning applies.
+  def wide_data
+    srand(5)
+    Array.new(300) { c = rand(6); Array.new(600) {|d| (c * 7 + d) % 5 + rand(3)} }
+  end
+
+  # one k-means iteration of the loop in cluster.c, with every centroid recomputed from all of its members.
+  def lloyd_step data, clusters, nclusters, weights
+    centroids = (0...nclusters).map do |c|
+      members = data.each_index.select {|i| clusters[i] == c}
+      total   = members.sum {|i| weights[i]}
+      (0...data[0].size).map {|d| members.sum {|i| weights[i] * data[i][d]} / total}
+    end
+    distance = ->(i, c) { data[i].zip(centroids[c]).sum {|x, y| (x - y) * (x - y)} / data[i].size }
+    counts   = clusters.tally
+    clusters = clusters.dup
+    data.each_index do |i|
+      k = clusters[i]
+      next if counts[k] == 1
+      best = distance[i, k]
+      (0...nclusters).each do |c|
+        next if c == k || distance[i, c] >= best
+        best = distance[i, c]
+        counts[clusters[i]] -= 1
+        counts[c] = counts.fetch(c, 0) + 1
+        clusters[i] = c
+      end
+    end
+    clusters
+  end
+
+  # integer values, so that the sums of the centroids are exact whatever the order they are summed in.
+  def test_incremental_sums_match_full_recompute
+    srand(6)
+    data = Array.new(300) { [rand(20).to_f, rand(20).to_f] }
+    [Array.new(300, 1.0), Array.new(300) {|i| 1.0 + i % 4}].each do |weights|
+      options = {iterations: 1, random_seed: 2, sample_weights: weights}
+      steps   = 0
+      (1..8).each_cons(2) do |m, n|
+        before = Flock.kcluster(6, data, options.merge(max_iterations: m))
+        after  = Flock.kcluster(6, data, options.merge(max_iterations: n))
+        next unless after[:error_trace][0].size == n
+        assert_equal lloyd_step(data, before[:cluster], 6, weights), after[:cluster], "iteration #{n}"
+        steps += 1
+      end
+      assert_operator steps, :>, 2
+    end
+  end
+
+  def test_early_abandon_leaves_results_unchanged
+    data = wide_data
+    [Flock::METHOD_AVERAGE, Flock::METHOD_MEDIAN].each do |method|
+      [Flock::METRIC_EUCLIDIAN, Flock::METRIC_CITY_BLOCK].each do |metric|
+        options  = {iterations: 3, random_seed: 1, method: method, metric: metric}
+        pruned   = Flock.kcluster(6, data, options.merge(early_abandon: true))
+        expected = Flock.kcluster(6, data, options.merge(early_abandon: false))
+        assert_operator pruned[:skipped_terms], :>, 0
+        assert_equal 0, expected[:skipped_terms]
+        %i(cluster error error_trace).each {|key| assert_equal expected[key], pruned[key], "#{key} #{method} #{metric}"}
+      end
+    end
+  end
+
+  # two well separated groups of skewed values, sorted so that members in index order are biased.
+  def sorted_groups
+    values = Array.new(4000) {|i| (i / 4000.0) ** 3}
+    values.map {|v| [v]} + values.map {|v| [10 + v]}
+  end
+
+  # the sampled median is within the bound documented for :median_sample, with d = 0.001.
+  def test_median_sample_within_bound
+    data  = sorted_groups
+    bound = Math.sqrt(Math.log(2 / 0.001) / (2 * 200))
+    [nil, Array.new(data.size) {|i| 1 + i % 3}].each do |weights|
+      options = {iterations: 1, method: Flock::METHOD_MEDIAN, median_sample: 200, random_seed: 3}
+      options[:sample_weights] = weights if weights
+      result = Flock.kcluster(2, data, options)
+      result[:centroid].each_with_index do |(median), c|
+        members = data.each_index.select {|i| result[:cluster][i] == c}
+        total   = members.sum {|i| weights ? weights[i] : 1}
+        below   = members.sum {|i| data[i][0] < median ? (weights ? weights[i] : 1) : 0}
+        assert_equal 4000, members.size
+        assert_in_delta 0.5, below.to_f / total, bound, "weights #{!!weights}, cluster #{c}"
+      end
+      assert_equal result, Flock.kcluster(2, data, options)
+    end
+  end
+
+  def test_passes_never_abort_without_abort_passes
+    result = Flock.kcluster(25, uniform_data, iterations: 20, random_seed: 7, abort_passes: false)
+    assert_equal 20, result[:error_trace].size
+    result[:error_trace].each_with_index {|errors, pass| assert converged?(errors), "pass #{pass}"}
+  end
+
+  def test_abort_passes_abandons_improving_passes
+    result = Flock.kcluster(25, uniform_data, iterations: 20, random_seed: 7, abort_passes: true)
+    refute result[:error_trace].all? {|errors| converged?(errors)}
+  end
+end
@@ -0,0 +1,64 @@
+require 'minitest/autorun'
+require 'rbconfig'
+require_relative '../lib/flock'
+
+# Checks that random_seed reproduces kcluster, kmedoids and self_organizing_map, in a fresh process and with any
+# number of OpenMP threads, and that Spearman distances ranked in parallel match those ranked in one thread.
+class TestRandomSeed < Minitest::Test
+  SCRIPT = <<-RUBY
+    require #{File.expand_path('../lib/flock', __dir__).dump}
+    srand(21)
+    data   = Array.new(400) { Array.new(6) { rand } }
+    seed   = Integer(ARGV[0])
+    result = [
+      Flock.kcluster(5, data, iterations: 4, seed: Flock::SEED_KMEANS_PLUSPLUS, random_seed: seed),
+      Flock.kcluster(5, data, iterations: 2, coreset: 100, random_seed: seed),
+      Flock.kmedoids(5, Flock::DistanceMatrix.new(data), iterations: 3, random_seed: seed),
+      Flock.self_organizing_map(3, 3, data, iterations: 50, random_seed: seed)
+    ]
+    print Marshal.dump(result)
+  RUBY
+
+  # integer values, so that ranks tie often.
+  SPEARMAN_SCRIPT = <<-RUBY
+    require #{File.expand_path('../lib/flock', __dir__).dump}
+    srand(23)
+    data   = Array.new(300) { Array.new(40) { rand(8) } }
+    result = [
+      Flock::DistanceMatrix.new(data, metric: Flock::METRIC_SPEARMAN).dump,
+      Flock.kcluster(4, data, iterations: 3, metric: Flock::METRIC_SPEARMAN, seed: Flock::SEED_KMEANS_PLUSPLUS,
+                     random_seed: 1),
+      Flock.treecluster(4, data, metric: Flock::METRIC_SPEARMAN, method: Flock::METHOD_SINGLE_LINKAGE)[:cluster]
+    ]
+    print Marshal.dump(result)
+  RUBY
+
+  def run_with seed, threads, script = SCRIPT
+    output = IO.popen({'OMP_NUM_THREADS' => threads.to_s}, [RbConfig.ruby, '-e', script, seed.to_s], 'rb', &:read)
+    assert $?.success?, "seed #{seed} with #{threads} threads failed"
+    Marshal.load(output)
+  end
+
+  def test_same_seed_same_result_across_runs_and_threads
+    [0, 42].each do |seed|
+      expected = run_with(seed, 1)
+      [1, 2, 4].each {|threads| assert_equal expected, run_with(seed, threads), "seed #{seed}, #{threads} threads"}
+    end
+  end
+
+  def test_spearman_in_parallel
+    expected = run_with(0, 1, SPEARMAN_SCRIPT)
+    [2, 4].each {|threads| assert_equal expected, run_with(0, threads, SPEARMAN_SCRIPT), "#{threads} threads"}
+  end
+
+  def test_seeds_differ
+    refute_equal run_with(0, 1), run_with(1, 1)
+  end
+
+  def test_missing_seed_varies
+    srand(22)
+    data    = Array.new(300) { [rand, rand] }
+    results = Array.new(5) { Flock.kcluster(8, data, iterations: 1)[:cluster] }
+    assert_operator results.uniq.size, :>, 1
+  end
+end
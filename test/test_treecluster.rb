@@ -0,0 +1,110 @@
+require 'minitest/autorun'
+require_relative '../lib/flock'
+
+# Compares treecluster against the closest pair search of the original Cluster 3.0 pmlcluster and palcluster,
+# which merges the first closest pair in a scan of the rows, on data where many distances are equal.
+class TestTreecluster < Minitest::Test
+  # pmlcluster (method 'm') or palcluster (method 'a') of Cluster 3.0, on a copy of the distances.
+  def reference_tree matrix, method
+    n         = matrix.size
+    distance  = Array.new(n) {|i| Array.new(i) {|j| matrix[i, j]}}
+    clusterid = (0...n).to_a
+    number    = Array.new(n, 1)
+
+    n.downto(2).map do |size|
+      is, js = 1, 0
+      (1...size).each do |i|
+        (0...i).each {|j| is, js = i, j if distance[i][j] < distance[is][js]}
+      end
+      merge = [clusterid[is], clusterid[js], distance[is][js]]
+
+      at = ->(i, j) { i > j ? distance[i][j] : distance[j][i] }
+      (0...size).each do |j|
+        next if j == is || j == js
+        value = method == 'm' ? [at[is, j], at[js, j]].max
+                              : (at[is, j] * number[is] + at[js, j] * number[js]) / (number[is] + number[js])
+        j < js ? distance[js][j] = value : distance[j][js] = value
+      end
+      (0...size - 1).each {|j| next if j == is; j < is ? distance[is][j] = at[size - 1, j] : distance[j][is] = at[size - 1, j]}
+
+      number[js]   += number[is]
+      number[is]    = number[size - 1]
+      clusterid[js] = size - n - 1
+      clusterid[is] = clusterid[size - 1]
+      merge
+    end
+  end
+
+  # the clusters as sets of data points, whatever their numbering.
+  def partition labels
+    labels.each_with_index.group_by(&:first).values.map {|members| members.map(&:last)}.sort
+  end
+
+  def integer_data
+    srand(11)
+    Array.new(60) { Array.new(3) { rand(4) } }
+  end
+
+  def binary_data
+    srand(12)
+    Array.new(40) { Array.new(8) { rand < 0.3 ? 1 : 0 } }
+  end
+
+  def test_ties_merge_in_the_original_order
+    [integer_data, binary_data].each do |data|
+      matrix = Flock::DistanceMatrix.new(data)
+      %w(m a).each do |method|
+        expected = reference_tree(matrix, method)
+        assert_equal expected, Flock.treecluster(2, data, method: method.ord)[:tree].to_a, "method #{method}"
+        assert_equal expected, Flock.treecluster(2, matrix, method: method.ord)[:tree].to_a, "method #{method}"
+      end
+    end
+  end
+
+  def test_flat_clusters_match_the_tree_on_ties
+    data = integer_data
+    tree = Flock.treecluster(2, data)[:tree]
+    [1, 2, 5, 17, 59, 60].each do |size|
+      assert_equal partition(tree.cut(size)), partition(Flock.treecluster(size, data, flat: true)[:cluster]),
+                   "size #{size}"
+    end
+  end
+
+  # on disk the matrix is stored in 32 x 32 tiles, so the data spans several tiles, the last ones partly filled.
+  def test_on_disk_matches_memory
+    srand(13)
+    data = Array.new(100) { Array.new(3) { rand(5) } }
+    %w(m a w c).each do |method|
+      [{}, {nn_chain: true}, {float_distances: true}].each do |options|
+        options  = options.merge(method: method.ord)
+        expected = Flock.treecluster(2, data, options)[:tree].to_a
+        assert_equal expected, Flock.treecluster(2, data, options.merge(on_disk: true))[:tree].to_a,
+                     "method #{method} #{options}"
+      end
+    end
+  end
+
+  def test_on_disk_distance_matrix_round_trips
+    srand(14)
+    data = Array.new(70) { Array.new(4) { rand } }
+    [false, true].each do |float|
+      memory = Flock::DistanceMatrix.new(data, float_distances: float)
+      disk   = Flock::DistanceMatrix.new(data, float_distances: float, on_disk: true)
+      assert_equal memory.dump, disk.dump
+      [[69, 0], [0, 69], [33, 31], [40, 64]].each {|i, j| assert_equal memory[i, j], disk[i, j]}
+      loaded = Flock::DistanceMatrix.load(memory.dump, float_distances: float, on_disk: true)
+      assert_equal memory.dump, loaded.dump
+      assert_equal memory.dump, loaded.dup.dump
+      values = memory.dump.unpack(float ? 'F*' : 'D*')
+      assert_equal memory.dump, Flock::DistanceMatrix.load(values, float_distances: float, on_disk: true).dump
+      assert_equal Flock.treecluster(2, memory)[:tree].to_a, Flock.treecluster(2, loaded)[:tree].to_a
+    end
+  end
+
+  def test_nn_chain_cuts_partition_the_data
+    data = binary_data
+    tree = Flock.treecluster(2, data, nn_chain: true)[:tree]
+    assert_equal data.size - 1, tree.to_a.size
+    (1..data.size).each {|size| assert_equal size, tree.cut(size).uniq.size}
+  end
+end